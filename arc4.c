@@ -142,16 +142,138 @@ arc4_initkey(struct arc4_stream *as, u_char *key, int keylen)
 void
 arc4_fixedkey(struct arc4_stream *as, u_char *key, int keylen)
 {
-	u_char digest[5];
+	u_char digest[ARC4_DIGESTLEN];
 	int i;
 
 	memset(digest, 0, sizeof(digest));
 	for (i = 0; i < keylen; i++)
-		digest[i % 5] ^= key[i];
+		digest[i % ARC4_DIGESTLEN] ^= key[i];
 		
 	arc4_init(as); 
-	arc4_addrandom(as, digest, 5);
+	arc4_addrandom(as, digest, ARC4_DIGESTLEN);
 
 	/* Reset */
 	as->i = as->j = 0;
 }
+
+/*
+ * The lanes functions run ARC4_LANES independent streams side by side.
+ * A single stream waits on every load from s[]; interleaving streams
+ * lets the loads of one overlap with the others.
+ */
+
+#if ARC4_LANES != 4
+#error The lanes functions are written for four streams.
+#endif
+
+#define ARC4_KEYSTEP(s, i, j, k) do { \
+	u_int8_t si; \
+	i++; \
+	si = s[i]; \
+	j = (j + si + (k)); \
+	s[i] = s[j]; \
+	s[j] = si; \
+} while (0)
+
+void
+arc4_addrandom_lanes(struct arc4_stream **as, u_char **dat, int datlen,
+    int n)
+{
+	u_int8_t *s0, *s1, *s2, *s3;
+	u_int8_t i0, i1, i2, i3, j0, j1, j2, j3;
+	int k, ki;
+
+	if (n < ARC4_LANES) {
+		for (k = 0; k < n; k++)
+			arc4_addrandom(as[k], dat[k], datlen);
+		return;
+	}
+
+	s0 = as[0]->s; i0 = as[0]->i - 1; j0 = as[0]->j;
+	s1 = as[1]->s; i1 = as[1]->i - 1; j1 = as[1]->j;
+	s2 = as[2]->s; i2 = as[2]->i - 1; j2 = as[2]->j;
+	s3 = as[3]->s; i3 = as[3]->i - 1; j3 = as[3]->j;
+
+	ki = 0;
+	for (k = 0; k < 256; k++) {
+		ARC4_KEYSTEP(s0, i0, j0, dat[0][ki]);
+		ARC4_KEYSTEP(s1, i1, j1, dat[1][ki]);
+		ARC4_KEYSTEP(s2, i2, j2, dat[2][ki]);
+		ARC4_KEYSTEP(s3, i3, j3, dat[3][ki]);
+
+		if (++ki >= datlen)
+			ki = 0;
+	}
+
+	as[0]->i = i0; as[0]->j = j0;
+	as[1]->i = i1; as[1]->j = j1;
+	as[2]->i = i2; as[2]->j = j2;
+	as[3]->i = i3; as[3]->j = j3;
+}
+
+void
+arc4_skipbytes_lanes(struct arc4_stream **as, int n, int skip)
+{
+	u_int8_t *s0, *s1, *s2, *s3;
+	u_int8_t i0, i1, i2, i3, j0, j1, j2, j3;
+	int k;
+
+	if (n < ARC4_LANES) {
+		for (k = 0; k < n; k++)
+			arc4_skipbytes(as[k], skip);
+		return;
+	}
+
+	s0 = as[0]->s; i0 = as[0]->i; j0 = as[0]->j;
+	s1 = as[1]->s; i1 = as[1]->i; j1 = as[1]->j;
+	s2 = as[2]->s; i2 = as[2]->i; j2 = as[2]->j;
+	s3 = as[3]->s; i3 = as[3]->i; j3 = as[3]->j;
+
+	while (skip-- > 0) {
+		ARC4_KEYSTEP(s0, i0, j0, 0);
+		ARC4_KEYSTEP(s1, i1, j1, 0);
+		ARC4_KEYSTEP(s2, i2, j2, 0);
+		ARC4_KEYSTEP(s3, i3, j3, 0);
+	}
+
+	as[0]->i = i0; as[0]->j = j0;
+	as[1]->i = i1; as[1]->j = j1;
+	as[2]->i = i2; as[2]->j = j2;
+	as[3]->i = i3; as[3]->j = j3;
+}
+
+void
+arc4_initkey_lanes(struct arc4_stream **as, u_char **key, int *keylen, int n)
+{
+	MD5_CTX ctx;
+	u_char digest[ARC4_LANES][16], *pdigest[ARC4_LANES];
+	int k;
+
+	for (k = 0; k < n; k++) {
+		MD5Init(&ctx);
+		MD5Update(&ctx, key[k], keylen[k]);
+		MD5Final(digest[k], &ctx);
+
+		arc4_init(as[k]);
+		pdigest[k] = digest[k];
+	}
+
+	arc4_addrandom_lanes(as, pdigest, 16, n);
+}
+
+/* Keys the streams from digests as computed by arc4_fixedkey */
+
+void
+arc4_digestkey_lanes(struct arc4_stream **as, u_char **digest, int n)
+{
+	int k;
+
+	for (k = 0; k < n; k++)
+		arc4_init(as[k]);
+
+	arc4_addrandom_lanes(as, digest, ARC4_DIGESTLEN, n);
+
+	/* Reset */
+	for (k = 0; k < n; k++)
+		as[k]->i = as[k]->j = 0;
+}
@@ -41,8 +41,19 @@ void arc4_addrandom(struct arc4_stream *, u_char *, int);
 void arc4_initkey(struct arc4_stream *, u_char *, int);
 void arc4_fixedkey(struct arc4_stream *, u_char *, int);
 
+/* arc4_fixedkey folds any key into a digest of this many bytes */
+#define ARC4_DIGESTLEN	5
+
 void arc4_skipbytes(struct arc4_stream *, int);
 
+/* Number of streams that the lanes functions advance together */
+#define ARC4_LANES	4
+
+void arc4_addrandom_lanes(struct arc4_stream **, u_char **, int, int);
+void arc4_skipbytes_lanes(struct arc4_stream **, int, int);
+void arc4_initkey_lanes(struct arc4_stream **, u_char **, int *, int);
+void arc4_digestkey_lanes(struct arc4_stream **, u_char **, int);
+
 u_int32_t arc4_getword(struct arc4_stream *);
 u_int8_t arc4_getbyte(struct arc4_stream *);
 void arc4_init(struct arc4_stream *);
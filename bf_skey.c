@@ -63,10 +63,12 @@
 #include "bf_locl.h"
 #include "bf_pi.h"
 
-void BF_set_key(BF_KEY *key, int len, const unsigned char *data)
+/* Copies the initial state and mixes the key into P */
+
+static void BF_set_key_init(BF_KEY *key, int len, const unsigned char *data)
 	{
 	int i;
-	BF_LONG *p,ri,in[2];
+	BF_LONG *p,ri;
 	const unsigned char *d,*end;
 
 
@@ -96,6 +98,15 @@ void BF_set_key(BF_KEY *key, int len, const unsigned char *data)
 
 		p[i]^=ri;
 		}
+	}
+
+void BF_set_key(BF_KEY *key, int len, const unsigned char *data)
+	{
+	int i;
+	BF_LONG *p,in[2];
+
+	BF_set_key_init(key,len,data);
+	p=key->P;
 
 	in[0]=0L;
 	in[1]=0L;
@@ -115,3 +126,98 @@ void BF_set_key(BF_KEY *key, int len, const unsigned char *data)
 		}
 	}
 
+
+/* Encrypts one block under each of BF_LANES keys.  The lanes do not
+ * depend on each other, so the S-box lookups of one lane overlap with
+ * the rounds of the others instead of waiting on a single chain.
+ */
+
+#if BF_LANES != 4
+#error BF_encrypt_lanes is written for four lanes.
+#endif
+
+#define BF_ENC_LANES(LL,R,i) ( \
+	BF_ENC(LL[0],R[0],s0,p0[i]), \
+	BF_ENC(LL[1],R[1],s1,p1[i]), \
+	BF_ENC(LL[2],R[2],s2,p2[i]), \
+	BF_ENC(LL[3],R[3],s3,p3[i]) \
+	)
+
+static void BF_encrypt_lanes(BF_LONG *data, BF_KEY **key)
+	{
+	BF_LONG l[BF_LANES],r[BF_LANES],t;
+	const BF_LONG *p0,*p1,*p2,*p3,*s0,*s1,*s2,*s3;
+	int i,j;
+
+	p0=key[0]->P; s0=key[0]->S;
+	p1=key[1]->P; s1=key[1]->S;
+	p2=key[2]->P; s2=key[2]->S;
+	p3=key[3]->P; s3=key[3]->S;
+
+	for (j=0; j<BF_LANES; j++)
+		{
+		l[j]=data[2*j  ]^key[j]->P[0];
+		r[j]=data[2*j+1];
+		}
+
+	for (i=1; i<=BF_ROUNDS; i+=2)
+		{
+		BF_ENC_LANES(r,l,i);
+		BF_ENC_LANES(l,r,i+1);
+		}
+
+	for (j=0; j<BF_LANES; j++)
+		{
+		t=r[j]^key[j]->P[BF_ROUNDS+1];
+		data[2*j+1]=l[j]&0xffffffffL;
+		data[2*j  ]=t&0xffffffffL;
+		}
+	}
+
+/* Computes the key schedules for n keys at once.  The result is the
+ * same as calling BF_set_key for each of them; fewer than BF_LANES
+ * keys take the scalar path.
+ */
+
+void BF_set_keys(BF_KEY **key, int n, const int *len,
+	const unsigned char **data)
+	{
+	BF_LONG in[2*BF_LANES];
+	BF_LONG *p;
+	int i,j;
+
+	if (n < BF_LANES)
+		{
+		for (j=0; j<n; j++)
+			BF_set_key(key[j],len[j],data[j]);
+		return;
+		}
+
+	for (j=0; j<BF_LANES; j++)
+		{
+		BF_set_key_init(key[j],len[j],data[j]);
+		in[2*j]=in[2*j+1]=0L;
+		}
+
+	for (i=0; i<(BF_ROUNDS+2); i+=2)
+		{
+		BF_encrypt_lanes(in,key);
+		for (j=0; j<BF_LANES; j++)
+			{
+			p=key[j]->P;
+			p[i  ]=in[2*j  ];
+			p[i+1]=in[2*j+1];
+			}
+		}
+
+	for (i=0; i<4*256; i+=2)
+		{
+		BF_encrypt_lanes(in,key);
+		for (j=0; j<BF_LANES; j++)
+			{
+			p=key[j]->S;
+			p[i  ]=in[2*j  ];
+			p[i+1]=in[2*j+1];
+			}
+		}
+	}
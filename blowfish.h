@@ -89,6 +89,10 @@ extern "C" {
  * So I've chosen long...
  *					<appro@fy.chalmers.se>
  */
+#elif defined(_LP64) || defined(__LP64__)
+/* Keeps the key schedule as small as on 32-bit machines */
+#define BF_LONG unsigned int
+#define BF_LONG_LOG2 2
 #else
 #define BF_LONG unsigned int
 #endif
@@ -105,6 +109,12 @@ typedef struct bf_key_st
  
 void BF_set_key(BF_KEY *key, int len, const unsigned char *data);
 
+/* Number of key schedules that BF_set_keys computes side by side */
+#define BF_LANES	4
+
+void BF_set_keys(BF_KEY **key, int n, const int *len,
+	const unsigned char **data);
+
 void BF_encrypt(BF_LONG *data,const BF_KEY *key);
 void BF_decrypt(BF_LONG *data,const BF_KEY *key);
 
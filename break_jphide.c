@@ -29,6 +29,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -47,24 +48,49 @@
 #include "break_jphide.h"
 #include "config.h"
 #include "common.h"
-
-int break_jphide_v3(void *, BF_KEY *);
-int break_jphide_v5(void *, BF_KEY *);
+#include "db.h"
 
 extern JBLOCKARRAY dctcompbuf[];
 
+#ifndef MIN
+#define		MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
 typedef u_int32_t blf_block[2];
 
 #define NKSTREAMS 4
 
-BF_KEY *ctx;
-u_int prngn[NKSTREAMS];
-blf_block prngstate[NKSTREAMS];
+/* Position of the decoder in the coefficients of one image */
+struct jphstate {
+	BF_KEY *ctx;
+	u_int prngn[NKSTREAMS];
+	blf_block prngstate[NKSTREAMS];
+
+	int coef, mode, spos;
+	int lh, lt, lw, where;
+	short *coeff;
+	int *lwib, *lhib;
+};
+
+#if DB_LANES > BF_LANES
+#error A group of words does not fit into the Blowfish lanes.
+#endif
 
-int coef, mode, spos;
-int lh, lt, lw, where;
-short *coeff;
-int *lwib, *lhib;
+/* Key schedules for the last words, kept by each cracking thread */
+struct jphcache {
+	u_char iv[8];		/* version 5 marker */
+	char oword[BF_LANES][DB_WORDLEN];	/* version 3 marker */
+	int nwords;
+	BF_KEY ctxv5[BF_LANES];
+	BF_KEY ctxv3[BF_LANES];
+	int initv5, initv3;
+	int version;		/* of the last embedding found */
+
+	struct jphstate st;
+};
+
+int break_jphide_v3(struct jphstate *, void *, BF_KEY *);
+int break_jphide_v5(struct jphstate *, void *, BF_KEY *);
 
 #ifdef WORDS_BIGENDIAN
 #define BLF_ENC(x,y) do { \
@@ -177,66 +203,66 @@ break_jphide_write(char *filename, void *arg)
 }
 
 u_char
-get_code_bit(int k)
+get_code_bit(struct jphstate *st, int k)
 {
 	u_int8_t a;
 	u_int32_t n;
 
-	if ((n = prngn[k]++ & 0x3f) == 0)
-		BLF_ENC(prngstate[k], ctx);
+	if ((n = st->prngn[k]++ & 0x3f) == 0)
+		BLF_ENC(st->prngstate[k], st->ctx);
 
-	a = ((u_char *)(prngstate[k]))[n >> 3] << (n & 0x07);
+	a = ((u_char *)(st->prngstate[k]))[n >> 3] << (n & 0x07);
 
 	return (a & 0x80 ? 1 : 0);
 }
 
 int
-get_word(int *value)
+get_word(struct jphstate *st, int *value)
 {
 	int y;
 
 	while (1) {
-		lw += 64;
-		if (lw > lwib[coef]) {
-			lh++;
-			lw = spos;
-			if (lh >= lhib[coef]) {
-				lt += 3;
-				if (ltab[lt] < 0) {
+		st->lw += 64;
+		if (st->lw > st->lwib[st->coef]) {
+			st->lh++;
+			st->lw = st->spos;
+			if (st->lh >= st->lhib[st->coef]) {
+				st->lt += 3;
+				if (ltab[st->lt] < 0) {
 					return (1);
 				}
 
-				coef = ltab[lt];
-				lh = 0;
-				lw = spos = ltab[lt + 1];
-				mode = ltab[lt + 2];
+				st->coef = ltab[st->lt];
+				st->lh = 0;
+				st->lw = st->spos = ltab[st->lt + 1];
+				st->mode = ltab[st->lt + 2];
 			}
 		} 
 		
-		y = coeff[where++];
+		y = st->coeff[st->where++];
 
-		if (coef == 0 && lh == 0 && (lw <= 7))
+		if (st->coef == 0 && st->lh == 0 && (st->lw <= 7))
 			continue;
 
-		if (mode < 0) {
-			if ((y >= mode) && (y <= -mode))
+		if (st->mode < 0) {
+			if ((y >= st->mode) && (y <= -st->mode))
 				continue;
 
-			if (!get_code_bit(0) && !get_code_bit(0))
+			if (!get_code_bit(st, 0) && !get_code_bit(st, 0))
 				continue;
 		} else {
-			if (mode == 3 && !get_code_bit(0))
+			if (st->mode == 3 && !get_code_bit(st, 0))
 				continue;
 
 			if ((y >= -1) && (y <= 1)) {
-				if (get_code_bit(0))
+				if (get_code_bit(st, 0))
 					continue;
 
-				if (mode && get_code_bit(0))
+				if (st->mode && get_code_bit(st, 0))
 					continue;
 			}
 
-			if (mode > 1 && !get_code_bit(0))
+			if (st->mode > 1 && !get_code_bit(st, 0))
 				continue;
 		}
 
@@ -246,17 +272,17 @@ get_word(int *value)
 }
 
 int
-get_bit(void)
+get_bit(struct jphstate *st)
 {
 	int y;
 
-	if (get_word(&y))
+	if (get_word(st, &y))
 		return (-1);
 
 	if (y < 0)
 		y = 0 - y;
 
-	if (mode < 0) {
+	if (st->mode < 0) {
 		y &= 2;
 		y >>= 1;
 	} else
@@ -271,6 +297,21 @@ break_jphide_destroy(void *obj)
 	free(obj);
 }
 
+/* The first six bytes of the IV are part of the version 5 key */
+
+u_int32_t
+break_jphide_hash(void *obj)
+{
+	struct jphobj *job = obj;
+	u_int32_t hash = 2166136261U;
+	int i;
+
+	for (i = 0; i < 6; i++)
+		hash = (hash ^ job->iv[i]) * 16777619;
+
+	return (hash);
+}
+
 int
 break_jphide_compare(void *obj1, void *obj2)
 {
@@ -284,6 +325,7 @@ void *
 break_jphide_prepare(int bits)
 {
 	struct jphobj *job;
+	int coef, spos, lh, lt, lw;
 	int i;
 
 	job = malloc(sizeof(struct jphobj));
@@ -327,88 +369,145 @@ break_jphide_prepare(int bits)
 	return (job);
 }
 
+void *
+break_jphide_state_new(void)
+{
+	struct jphcache *jc;
+
+	if ((jc = calloc(1, sizeof(struct jphcache))) == NULL)
+		err(1, "calloc");
+
+	return (jc);
+}
+
+void
+break_jphide_state_free(void *state)
+{
+	free(state);
+}
+
 int
-crack_jphide(char *filename, char *word, void *obj)
+crack_jphide(char *filename, char *word, void *obj, void *state)
 {
-	static u_char iv[8];		/* version 5 marker */
-	static u_char oword[57];	/* version 3 marker */
-	static BF_KEY ctxv5;
-	static BF_KEY ctxv3;
-	static int initv5, initv3;
-	struct jphobj *job = obj;
-	int changed = 0;
+	return (crack_jphide_lanes(filename, &word, 1, obj, state) != -1);
+}
+
+/*
+ * Tries up to BF_LANES words and returns the index of the first one
+ * that reveals an embedding, or -1.  The key schedules dominate, so
+ * they are computed for all words at once.  The hit is printed by
+ * break_jphide_report().
+ */
 
-	if (strcmp(word, oword)) {
-		strlcpy(oword, word, sizeof(oword));
-		changed = 1;
-		initv3 = 0;
+int
+crack_jphide_lanes(char *filename, char **words, int n, void *obj,
+    void *state)
+{
+	struct jphcache *jc = state;
+	struct jphobj *job = obj;
+	BF_KEY *ctx[BF_LANES];
+	const u_char *data[BF_LANES];
+	u_char key[BF_LANES][(BF_ROUNDS + 2) * 4];
+	int len[BF_LANES];
+	int i, changed;
+
+	changed = n != jc->nwords;
+	for (i = 0; i < n && !changed; i++)
+		changed = strcmp(words[i], jc->oword[i]) != 0;
+
+	if (changed) {
+		for (i = 0; i < n; i++)
+			strlcpy(jc->oword[i], words[i], sizeof(jc->oword[i]));
+		jc->nwords = n;
+		jc->initv5 = jc->initv3 = 0;
 	}
 
-	if (!initv5 || changed || memcmp(iv, job->iv, 6)) {
-		u_char key[56];
+	if (!jc->initv5 || memcmp(jc->iv, job->iv, 6)) {
+		memcpy(jc->iv, job->iv, sizeof(jc->iv));
+		for (i = 0; i < n; i++) {
+			len[i] = MIN(strlen(words[i]), sizeof(key[i]) - 6);
+			memcpy(key[i], job->iv, 6);
+			memcpy(key[i] + 6, words[i], len[i]);
+			len[i] += 6;
 
-		memcpy(iv, job->iv, sizeof(iv));
-		memcpy(key, job->iv, 6);
-		memcpy(key + 6, word, strlen(word));
+			ctx[i] = &jc->ctxv5[i];
+			data[i] = key[i];
+		}
 
-		BF_set_key(&ctxv5, strlen(word) + 6, key);
+		BF_set_keys(ctx, n, len, data);
 
-		initv5 = 1;
+		jc->initv5 = 1;
 	}
 
-	if (break_jphide_v5(job, &ctxv5)) {
-		fprintf(stdout, "%s : jphide[v5](%s)\n",
-			filename, word);
-		return (1);
-	}
+	/* The version 3 keys do not depend on the image */
+	if (!jc->initv3) {
+		for (i = 0; i < n; i++) {
+			ctx[i] = &jc->ctxv3[i];
+			data[i] = (const u_char *)words[i];
+			len[i] = strlen(words[i]);
+		}
 
-	if (!initv3 || changed) {
-		BF_set_key(&ctxv3, strlen(word), word);
+		BF_set_keys(ctx, n, len, data);
 		
-		initv3 = 1;
+		jc->initv3 = 1;
 	}
 
-	if (break_jphide_v3(job, &ctxv3)) {
-		fprintf(stdout, "%s : jphide[v3](%s)\n",
-			filename, word);
-		return (1);
+	for (i = 0; i < n; i++) {
+		if (break_jphide_v5(&jc->st, job, &jc->ctxv5[i])) {
+			jc->version = 5;
+			return (i);
+		}
+
+		if (break_jphide_v3(&jc->st, job, &jc->ctxv3[i])) {
+			jc->version = 3;
+			return (i);
+		}
 	}
 
-	return (0);
+	return (-1);
+}
+
+void
+break_jphide_report(char *filename, char *word, void *obj, void *state)
+{
+	struct jphcache *jc = state;
+
+	fprintf(stdout, "%s : jphide[v%d](%s)\n", filename, jc->version, word);
 }
 
 void
-break_jphide_setup(u_char *iv, struct jphobj *job, BF_KEY *inctx)
+break_jphide_setup(struct jphstate *st, u_char *iv, struct jphobj *job,
+    BF_KEY *inctx)
 {
 	int i;
 
-	ctx = inctx;
+	st->ctx = inctx;
 	memcpy(iv, job->iv, sizeof(job->iv));
 
-	memset(prngn, 0, sizeof(prngn));
+	memset(st->prngn, 0, sizeof(st->prngn));
 	for (i = 0; i < NKSTREAMS; i++) {
-		memcpy(prngstate + i, iv, 8);
-		BLF_ENC(prngstate[i], ctx);
+		memcpy(st->prngstate + i, iv, 8);
+		BLF_ENC(st->prngstate[i], st->ctx);
 
 		iv[8] = iv[0]; 
 		memmove(iv, iv + 1, 8);
 	}
 
-	coef = ltab [0];
-	spos = ltab [1];
-	mode = ltab [2];
-	lh = 0;
-	lw = spos - 64;
-	lt = 0;
-
-	lwib = job->wib;
-	lhib = job->hib;
-	coeff = job->coeff;
-	where = 0;
+	st->coef = ltab [0];
+	st->spos = ltab [1];
+	st->mode = ltab [2];
+	st->lh = 0;
+	st->lw = st->spos - 64;
+	st->lt = 0;
+
+	st->lwib = job->wib;
+	st->lhib = job->hib;
+	st->coeff = job->coeff;
+	st->where = 0;
 }
 
 int
-break_jphide_getbytes(u_char *data, size_t len)
+break_jphide_getbytes(struct jphstate *st, u_char *data, size_t len)
 {
 	int i, j, b;
 	u_char v;
@@ -416,7 +515,7 @@ break_jphide_getbytes(u_char *data, size_t len)
 	for (i = 0; i < len; i++) {
 		v = 0;
 		for (j = 0; j < 8; j++) {
-			if ((b = get_bit()) < 0)
+			if ((b = get_bit(st)) < 0)
 				return (-1);
 
 			b = b << j;
@@ -429,19 +528,19 @@ break_jphide_getbytes(u_char *data, size_t len)
 }
 
 int
-break_jphide_v3 (void *obj, BF_KEY *inctx)
+break_jphide_v3(struct jphstate *st, void *obj, BF_KEY *inctx)
 {
 	blf_block lendata;
 	struct jphobj *job = obj;
 	int i, len0, len1, len2, length;
 	u_char iv[9];
 
-	break_jphide_setup(iv, job, inctx);
+	break_jphide_setup(st, iv, job, inctx);
 
-	if (break_jphide_getbytes((u_char *)lendata, 8) == -1)
+	if (break_jphide_getbytes(st, (u_char *)lendata, 8) == -1)
 		return (0);
 
-	BLF_DEC(lendata, ctx);
+	BLF_DEC(lendata, st->ctx);
 
 	len0 = ((u_char *)lendata)[0];
 	len1 = ((u_char *)lendata)[1];
@@ -453,7 +552,7 @@ break_jphide_v3 (void *obj, BF_KEY *inctx)
 		return (0);
 
 	/* Encrypt IV for comparison with decryption */
-	BLF_ENC((u_int32_t *)iv, ctx);
+	BLF_ENC((u_int32_t *)iv, st->ctx);
 
 	for (i = 3; i < 8; i++)
 		if (((u_char *)lendata)[i] != iv[i])
@@ -463,7 +562,7 @@ break_jphide_v3 (void *obj, BF_KEY *inctx)
 }
 
 int
-break_jphide_v5 (void *obj, BF_KEY *inctx)
+break_jphide_v5(struct jphstate *st, void *obj, BF_KEY *inctx)
 {
 	blf_block lendata[2];
 	struct jphobj *job = obj;
@@ -471,12 +570,12 @@ break_jphide_v5 (void *obj, BF_KEY *inctx)
 	int rlen0, rlen1, rlen2, rlength;
 	u_char iv[9], iv2[8], *p;
 
-	break_jphide_setup(iv, job, inctx);
+	break_jphide_setup(st, iv, job, inctx);
 
-	if (break_jphide_getbytes((u_char *)lendata, 8) == -1)
+	if (break_jphide_getbytes(st, (u_char *)lendata, 8) == -1)
 		return (0);
 
-	BLF_DEC(lendata[0], ctx);
+	BLF_DEC(lendata[0], st->ctx);
 	if (((u_char *)lendata)[3] > 3)
 		return (0);
 
@@ -489,17 +588,17 @@ break_jphide_v5 (void *obj, BF_KEY *inctx)
 	if (length * 8 >= job->bits)
 		return (0);
 
-	BLF_ENC((u_int32_t *)iv, ctx);
+	BLF_ENC((u_int32_t *)iv, st->ctx);
 
 	p = (u_char *)lendata;
 
 	if (memcmp(iv + 5, p + 5, 3))
 		return (0);
 
-	if (break_jphide_getbytes((u_char *)lendata[1], 8) == -1)
+	if (break_jphide_getbytes(st, (u_char *)lendata[1], 8) == -1)
 		return (0);
 
-	BLF_DEC(lendata[1], ctx);
+	BLF_DEC(lendata[1], st->ctx);
 
 	if (((u_char *)lendata)[9] != len1 ||
 	    ((u_char *)lendata)[10] != len2)
@@ -514,7 +613,7 @@ break_jphide_v5 (void *obj, BF_KEY *inctx)
 		return (0);
 
 	memcpy(iv2, iv, sizeof(iv2));
-	BLF_ENC((u_int32_t *)iv2, ctx);
+	BLF_ENC((u_int32_t *)iv2, st->ctx);
 
 	if (memcmp(iv2 + 4, p + 12, 4))
 		return (0);
@@ -31,10 +31,15 @@
 #ifndef _BREAK_JPHIDE_
 #define _BREAK_JPHIDE_
 
+u_int32_t break_jphide_hash(void *);
 int break_jphide_compare(void *, void *);
 void *break_jphide_prepare(int);
 void break_jphide_destroy(void *);
-int crack_jphide(char *, char *, void *);
+int crack_jphide(char *, char *, void *, void *);
+int crack_jphide_lanes(char *, char **, int, void *, void *);
+void break_jphide_report(char *, char *, void *, void *);
+void *break_jphide_state_new(void);
+void break_jphide_state_free(void *);
 
 void *break_jphide_read(char *);
 int break_jphide_write(char *, void *);
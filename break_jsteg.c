@@ -29,6 +29,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -48,6 +49,7 @@
 #include "common.h"
 #include "arc4.h"
 #include "break_jsteg.h"
+#include "db.h"
 
 #ifndef MIN
 #define		MIN(a,b) (((a)<(b))?(a):(b))
@@ -197,63 +199,250 @@ break_jsteg_prepare(char *filename, short *dcts, int bits)
 	return (jstegob);
 }
 
+#if DB_LANES > ARC4_LANES
+#error A group of words does not fit into the arc4 lanes.
+#endif
+
+/* Words are digests in hex, for the search of the whole key space */
+int jsteg_exhaustive = 0;
+
+/*
+ * Digests that have been tried against the current targets, stored
+ * plus one so that zero marks an empty slot.  When half full, the set
+ * starts over; that only costs repeated work.
+ */
+#define JSTEG_SEENBITS	20
+#define JSTEG_SEENSIZE	(1 << JSTEG_SEENBITS)
+
+/*
+ * Key schedules for the last words, kept by each cracking thread.  The
+ * targets come ordered by skip, so the running streams only move
+ * forward from one target to the next.  Words with a digest that has
+ * been tried before do not get a stream.
+ */
+struct jstegcache {
+	char oword[ARC4_LANES][DB_WORDLEN];
+	int nwords;
+	int lane[ARC4_LANES];		/* word of each stream */
+	int nlanes;
+	int hit;			/* stream of the last embedding */
+	struct arc4_stream as[ARC4_LANES];
+
+	int pos;			/* bytes skipped by the running streams */
+	struct arc4_stream run[ARC4_LANES];
+
+	u_int64_t *seen;
+	int nseen;
+	u_int32_t generation;
+};
+
+void *
+break_jsteg_state_new(void)
+{
+	struct jstegcache *jc;
+
+	if ((jc = calloc(1, sizeof(struct jstegcache))) == NULL)
+		err(1, "calloc");
+
+	return (jc);
+}
+
+void
+break_jsteg_state_free(void *state)
+{
+	struct jstegcache *jc = state;
+
+	free(jc->seen);
+	free(jc);
+}
+
+/* Computes the digest that arc4_fixedkey would key the stream with */
+
+void
+break_jsteg_digest(char *word, u_char *digest)
+{
+	u_int64_t val;
+	int i;
+
+	if (jsteg_exhaustive) {
+		val = strtoull(word, NULL, 16);
+		for (i = ARC4_DIGESTLEN - 1; i >= 0; i--) {
+			digest[i] = val;
+			val >>= 8;
+		}
+		return;
+	}
+
+	memset(digest, 0, ARC4_DIGESTLEN);
+	for (i = 0; word[i]; i++)
+		digest[i % ARC4_DIGESTLEN] ^= word[i];
+}
+
+/* Returns 1 if the digest has been tried, otherwise remembers it */
+
 int
-crack_jsteg(char *filename, char *word, void *obj)
+break_jsteg_seen(struct jstegcache *jc, u_char *digest)
 {
-	static u_char oword[57];
-	static int init;
-	static struct arc4_stream as;
-	
-	struct arc4_stream tas;
-	struct jstegobj *jstegob = obj;
-	int changed = 0;
+	u_int64_t val = 0;
+	u_int32_t slot;
+	int i;
 
-	if (strcmp(word, oword)) {
-		strlcpy(oword, word, sizeof(oword));
-		changed = 1;
-		init = 0;
+	if (jc->seen == NULL) {
+		jc->seen = calloc(JSTEG_SEENSIZE, sizeof(u_int64_t));
+		if (jc->seen == NULL)
+			err(1, "calloc");
 	}
 
-	if (!init || changed) {
-		arc4_fixedkey(&as, word, strlen(word));
-		init = 1;
+	/* New targets have not seen any digest */
+	if (jc->generation != db_generation() ||
+	    jc->nseen >= JSTEG_SEENSIZE / 2) {
+		memset(jc->seen, 0, JSTEG_SEENSIZE * sizeof(u_int64_t));
+		jc->nseen = 0;
+		jc->generation = db_generation();
 	}
 
-	tas = as;
-	if (break_jsteg(jstegob, &tas)) {
-		extern int noprint;
-		int i;
-		u_int8_t header[JSTEGHEADER];
-
-		fprintf(stdout, "%s : jsteg(%s)", filename, word);
-
-		/* Check if we have a header.  Try to file magic it */
-		for (i = 0; i < JSTEGHEADER; i++)
-			if (jstegob->header[i])
-				break;
-		if (i >= JSTEGHEADER)
-			goto out;
-
-		tas = as;
-		for (i = 0; i < JSTEGHEADER; i++)
-			header[i] = jstegob->header[i] ^ arc4_getbyte(&tas);
-		if (file_process(header, JSTEGHEADER) == 0)
-			goto out;
-
-		fprintf(stdout, "[");
-		noprint = 0;
-		file_process(header, JSTEGHEADER);
-		noprint = 1;
-		fprintf(stdout, "]");
-
-		out:
-		fprintf(stdout, "\n");
-		return (1);
+	for (i = 0; i < ARC4_DIGESTLEN; i++)
+		val = (val << 8) | digest[i];
+	val++;
+
+	slot = (val * 0x9e3779b97f4a7c15ULL) >> (64 - JSTEG_SEENBITS);
+	while (jc->seen[slot]) {
+		if (jc->seen[slot] == val)
+			return (1);
+		slot = (slot + 1) & (JSTEG_SEENSIZE - 1);
 	}
 
+	jc->seen[slot] = val;
+	jc->nseen++;
+
 	return (0);
 }
 
+/* Prints the embedding that crack_jsteg_lanes() has found */
+
+void
+break_jsteg_report(char *filename, char *word, void *obj, void *state)
+{
+	extern int noprint;
+	struct jstegcache *jc = state;
+	struct jstegobj *jstegob = obj;
+	struct arc4_stream tas;
+	u_int8_t header[JSTEGHEADER];
+	int i;
+
+	fprintf(stdout, "%s : jsteg%s(%s)", filename,
+	    jsteg_exhaustive ? "[digest]" : "", word);
+
+	/* Check if we have a header.  Try to file magic it */
+	for (i = 0; i < JSTEGHEADER; i++)
+		if (jstegob->header[i])
+			break;
+	if (i >= JSTEGHEADER)
+		goto out;
+
+	tas = jc->as[jc->hit];
+	for (i = 0; i < JSTEGHEADER; i++)
+		header[i] = jstegob->header[i] ^ arc4_getbyte(&tas);
+	if (file_process(header, JSTEGHEADER) == 0)
+		goto out;
+
+	fprintf(stdout, "[");
+	noprint = 0;
+	file_process(header, JSTEGHEADER);
+	noprint = 1;
+	fprintf(stdout, "]");
+
+ out:
+	fprintf(stdout, "\n");
+}
+
+int
+crack_jsteg(char *filename, char *word, void *obj, void *state)
+{
+	return (crack_jsteg_lanes(filename, &word, 1, obj, state) != -1);
+}
+
+/* Targets with less data come first */
+
+int
+break_jsteg_compare(void *obj1, void *obj2)
+{
+	struct jstegobj *js1 = obj1;
+	struct jstegobj *js2 = obj2;
+
+	if (js1->skip < js2->skip)
+		return (-1);
+
+	return (js1->skip > js2->skip);
+}
+
+/*
+ * Tries up to ARC4_LANES words and returns the index of the first one
+ * that reveals an embedding, or -1.  The streams of all words skip to
+ * the end of the data together, continuing from the previous target.
+ */
+
+int
+crack_jsteg_lanes(char *filename, char **words, int n, void *obj,
+    void *state)
+{
+	struct jstegcache *jc = state;
+	struct jstegobj *jstegob = obj;
+	struct arc4_stream tas, *pas[ARC4_LANES];
+	u_char digest[ARC4_LANES][ARC4_DIGESTLEN], *pdigest[ARC4_LANES];
+	int i, k, changed;
+
+	changed = n != jc->nwords;
+	for (i = 0; i < n && !changed; i++)
+		changed = strcmp(words[i], jc->oword[i]) != 0;
+
+	if (changed) {
+		jc->nlanes = 0;
+		for (i = 0; i < n; i++) {
+			strlcpy(jc->oword[i], words[i], sizeof(jc->oword[i]));
+
+			k = jc->nlanes;
+			break_jsteg_digest(words[i], digest[k]);
+			if (!jsteg_exhaustive && break_jsteg_seen(jc, digest[k]))
+				continue;
+
+			jc->lane[k] = i;
+			pas[k] = &jc->as[k];
+			pdigest[k] = digest[k];
+			jc->nlanes++;
+		}
+		jc->nwords = n;
+		jc->pos = -1;
+
+		arc4_digestkey_lanes(pas, pdigest, jc->nlanes);
+	}
+
+	if (!jc->nlanes)
+		return (-1);
+
+	if (jstegob->skip < jc->pos || jc->pos == -1) {
+		memcpy(jc->run, jc->as, sizeof(jc->run));
+		jc->pos = 0;
+	}
+
+	for (k = 0; k < jc->nlanes; k++)
+		pas[k] = &jc->run[k];
+	arc4_skipbytes_lanes(pas, jc->nlanes, jstegob->skip - jc->pos);
+	jc->pos = jstegob->skip;
+
+	for (k = 0; k < jc->nlanes; k++) {
+		tas = jc->run[k];
+		if (break_jsteg(jstegob, &tas)) {
+			jc->hit = k;
+			return (jc->lane[k]);
+		}
+	}
+
+	return (-1);
+}
+
+/* The stream has to be at the end of the data already */
+
 int
 break_jsteg(struct jstegobj *js, struct arc4_stream *as)
 {
@@ -261,8 +450,6 @@ break_jsteg(struct jstegobj *js, struct arc4_stream *as)
 	u_char *p;
 	int i;
 
-	arc4_skipbytes(as, js->skip);
-
 	p = js->coeff;
 	for (i = 0; i < sizeof(js->coeff); i++)
 		plain[i] = p[i] ^ arc4_getbyte(as);
@@ -33,7 +33,12 @@
 
 void *break_jsteg_prepare(char *, short *, int);
 void break_jsteg_destroy(void *);
-int crack_jsteg(char *, char *, void *);
+int break_jsteg_compare(void *, void *);
+int crack_jsteg(char *, char *, void *, void *);
+int crack_jsteg_lanes(char *, char **, int, void *, void *);
+void break_jsteg_report(char *, char *, void *, void *);
+void *break_jsteg_state_new(void);
+void break_jsteg_state_free(void *);
 
 void *break_jsteg_read(char *);
 int break_jsteg_write(char *, void *);
@@ -29,6 +29,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -48,6 +49,7 @@
 #include "common.h"
 #include "arc4.h"
 #include "break_outguess.h"
+#include "db.h"
 
 #ifndef MIN
 #define		MIN(a,b) (((a)<(b))?(a):(b))
@@ -68,8 +70,37 @@ typedef struct _iterator {
 	int off;		/* Current bit position */
 } iterator;
 
-int break_outguess(struct ogobj *, struct arc4_stream *, iterator *,
-    char **, int *);
+#define OGBUFLEN	512	/* decoded bytes tested for randomness */
+
+#if DB_LANES > ARC4_LANES
+#error A group of words does not fit into the arc4 lanes.
+#endif
+
+#define OGHDRBYTES	4	/* seed and length */
+
+/*
+ * Where the header bits are and what they are xored with depends
+ * only on the password.  It is computed once per word and then read
+ * from each target's coefficients.
+ */
+struct oghdr {
+	u_int32_t pos[OGHDRBYTES * 8];
+	u_char key[OGHDRBYTES];
+	iterator it;		/* positioned after the header */
+};
+
+/* Key schedules for the last words, kept by each cracking thread */
+struct ogcache {
+	char oword[ARC4_LANES][DB_WORDLEN];
+	int nwords;
+	struct arc4_stream as[ARC4_LANES];
+	struct oghdr hdr[ARC4_LANES];
+	u_char buf[OGBUFLEN];
+	int buflen;		/* of the last embedding found */
+};
+
+int break_outguess(struct ogobj *, struct arc4_stream *, struct oghdr *,
+    u_char *, int *);
 
 /* Globals */
 int min_len = 256;
@@ -94,6 +125,31 @@ iterator_init(iterator *iter, struct arc4_stream *as)
 	iter->off = arc4_getword(&iter->as) % iter->skipmod;
 }
 
+/* Same as iterator_init for the streams of several words */
+
+void
+iterator_init_lanes(iterator *iter, struct arc4_stream *as, int n)
+{
+	struct arc4_stream *pas[ARC4_LANES];
+	u_char derive[ARC4_LANES][16], *pderive[ARC4_LANES];
+	int i, k;
+
+	for (k = 0; k < n; k++) {
+		iter[k].skipmod = INIT_SKIPMOD;
+		iter[k].as = as[k];
+
+		for (i = 0; i < sizeof(derive[k]); i++)
+			derive[k][i] = arc4_getbyte(&iter[k].as);
+		pas[k] = &iter[k].as;
+		pderive[k] = derive[k];
+	}
+
+	arc4_addrandom_lanes(pas, pderive, sizeof(derive[0]), n);
+
+	for (k = 0; k < n; k++)
+		iter[k].off = arc4_getword(&iter[k].as) % iter[k].skipmod;
+}
+
 #define iterator_current(x)	(x)->off
 
 int
@@ -225,68 +281,135 @@ break_outguess_prepare(short *dcts, int bits)
 	return (ogob);
 }
 
+void *
+break_outguess_state_new(void)
+{
+	struct ogcache *oc;
+
+	if ((oc = calloc(1, sizeof(struct ogcache))) == NULL)
+		err(1, "calloc");
+
+	return (oc);
+}
+
+void
+break_outguess_state_free(void *state)
+{
+	free(state);
+}
+
 int
-crack_outguess(char *filename, char *word, void *obj)
+crack_outguess(char *filename, char *word, void *obj, void *state)
 {
-	static u_char oword[57];	/* version 3 marker */
-	static int init;
-	static struct arc4_stream as;
-	static iterator it;
-	char *buf;
-	int buflen;
-	
-	struct arc4_stream tas;
-	iterator tit;
-	struct ogobj *ogob = obj;
-	int changed = 0;
+	return (crack_outguess_lanes(filename, &word, 1, obj, state) != -1);
+}
+
+/*
+ * Tries up to ARC4_LANES words and returns the index of the first one
+ * that reveals an embedding, or -1.
+ */
+
+/* Follows the iterator over the header for the stream of one word */
 
-	if (strcmp(word, oword)) {
-		strlcpy(oword, word, sizeof(oword));
-		changed = 1;
-		init = 0;
+void
+break_outguess_header(struct oghdr *hdr, struct arc4_stream *as)
+{
+	struct arc4_stream tas = *as;
+	int i;
+
+	for (i = 0; i < OGHDRBYTES * 8; i++) {
+		hdr->pos[i] = iterator_current(&hdr->it);
+		iterator_next(&hdr->it);
 	}
 
-	if (!init || changed) {
-		arc4_initkey(&as, word, strlen(word));
-		iterator_init(&it, &as);
-		init = 1;
+	for (i = 0; i < OGHDRBYTES; i++)
+		hdr->key[i] = arc4_getbyte(&tas);
+}
+
+int
+crack_outguess_lanes(char *filename, char **words, int n, void *obj,
+    void *state)
+{
+	struct ogcache *oc = state;
+	struct ogobj *ogob = obj;
+	struct arc4_stream *pas[ARC4_LANES];
+	u_char *pword[ARC4_LANES];
+	iterator it[ARC4_LANES];
+	int len[ARC4_LANES];
+	int i, changed;
+
+	changed = n != oc->nwords;
+	for (i = 0; i < n && !changed; i++)
+		changed = strcmp(words[i], oc->oword[i]) != 0;
+
+	if (changed) {
+		for (i = 0; i < n; i++) {
+			strlcpy(oc->oword[i], words[i], sizeof(oc->oword[i]));
+			pas[i] = &oc->as[i];
+			pword[i] = (u_char *)words[i];
+			len[i] = strlen(words[i]);
+		}
+		oc->nwords = n;
+
+		arc4_initkey_lanes(pas, pword, len, n);
+		iterator_init_lanes(it, oc->as, n);
+		for (i = 0; i < n; i++) {
+			oc->hdr[i].it = it[i];
+			break_outguess_header(&oc->hdr[i], &oc->as[i]);
+		}
 	}
 
-	tas = as;
-	tit = it;
-	if (break_outguess(ogob, &tas, &tit, &buf, &buflen)) {
-		int i;
-		extern int noprint;
-		fprintf(stdout, "%s : outguess[v0.13b](%s)[",
-			filename, word);
-		noprint = 0;
-		file_process(buf, buflen);
-		noprint = 1;
-		fprintf(stdout, "][");
-		for (i = 0; i < 16; i++)
-			fprintf(stdout, "%c",
-			    isprint(buf[i]) ? buf[i] : '.');
-		fprintf(stdout, "]\n");
-		return (1);
+	for (i = 0; i < n; i++) {
+		if (break_outguess(ogob, &oc->as[i], &oc->hdr[i],
+			oc->buf, &oc->buflen))
+			return (i);
 	}
 
-	return (0);
+	return (-1);
+}
+
+/* Prints the data that crack_outguess_lanes() has decoded */
+
+void
+break_outguess_report(char *filename, char *word, void *obj, void *state)
+{
+	extern int noprint;
+	struct ogcache *oc = state;
+	int j;
+
+	fprintf(stdout, "%s : outguess[v0.13b](%s)[", filename, word);
+	noprint = 0;
+	file_process(oc->buf, oc->buflen);
+	noprint = 1;
+	fprintf(stdout, "][");
+	for (j = 0; j < 16; j++)
+		fprintf(stdout, "%c", isprint(oc->buf[j]) ? oc->buf[j] : '.');
+	fprintf(stdout, "]\n");
 }
 
+/*
+ * Decodes at most OGBUFLEN bytes into buf.  Most words fail the header
+ * checks, which only look up the precomputed bit positions.
+ */
+
 int
-break_outguess(struct ogobj *og, struct arc4_stream *as, iterator *it,
-    char **pbuf, int *pbuflen)
+break_outguess(struct ogobj *og, struct arc4_stream *as, struct oghdr *hdr,
+    u_char *buf, int *pbuflen)
 {
-	u_char state[4];
-	static u_char buf[512];
-	struct arc4_stream tas = *as;
-	int length, seed, need;
-	int bits, i, n;
+	u_char state[OGHDRBYTES];
+	struct arc4_stream tas;
+	iterator tit, *it;
+	int length, seed, need, res;
+	int bits, i, j, n;
+
+	for (i = 0; i < OGHDRBYTES; i++) {
+		u_int32_t *pos = &hdr->pos[i * 8];
 
-	state[0] = steg_retrbyte(og->coeff, 8, it) ^ arc4_getbyte(as);
-	state[1] = steg_retrbyte(og->coeff, 8, it) ^ arc4_getbyte(as);
-	state[2] = steg_retrbyte(og->coeff, 8, it) ^ arc4_getbyte(as);
-	state[3] = steg_retrbyte(og->coeff, 8, it) ^ arc4_getbyte(as);
+		state[i] = 0;
+		for (j = 0; j < 8; j++)
+			state[i] |= (TEST_BIT(og->coeff, pos[j]) != 0) << j;
+		state[i] ^= hdr->key[i];
+	}
 
 	seed = (state[1] << 8) | state[0];
 	length = (state[3] << 8) | state[2];
@@ -294,30 +417,36 @@ break_outguess(struct ogobj *og, struct arc4_stream *as, iterator *it,
 	if (seed > max_seed || length * 8 >= og->bits/2 || length < min_len)
 		return (0);
 
+	tit = hdr->it;
+	it = &tit;
 	iterator_seed(it, seed);
 
 	bits = MIN(og->bits, sizeof(og->coeff) * 8);
 
 	n = 0;
-	while (iterator_current(it) < bits && length > 0 && n < sizeof(buf)) {
+	while (iterator_current(it) < bits && length > 0 && n < OGBUFLEN) {
 		iterator_adapt(it, og->bits, length);
 		buf[n++] = steg_retrbyte(og->coeff, 8, it);
 		length--;
 	}
 
 	/* For testing the randomness, we need some extra information */
-	need = MIN(min_len, sizeof(buf));
+	need = MIN(min_len, OGBUFLEN);
 	if (n < need || !is_random(buf, n))
 		return (0);
 
 	/* Plaintext tests? */
+	tas = *as;
 	for (i = 0; i < n; i++)
 		buf[i] ^= arc4_getbyte(&tas);
 
-	if (file_process(buf, n) == 0)
+	/* The magic tests are not reentrant */
+	db_lock();
+	res = file_process(buf, n);
+	db_unlock();
+	if (res == 0)
 		return (0);
 
-	*pbuf = buf;
 	*pbuflen = n;
 
 	return (1);
@@ -33,7 +33,11 @@
 
 void *break_outguess_prepare(short *, int);
 void break_outguess_destroy(void *);
-int crack_outguess(char *, char *, void *);
+int crack_outguess(char *, char *, void *, void *);
+int crack_outguess_lanes(char *, char **, int, void *, void *);
+void break_outguess_report(char *, char *, void *, void *);
+void *break_outguess_state_new(void);
+void break_outguess_state_free(void *);
 
 void *break_outguess_read(char *);
 int break_outguess_write(char *, void *);
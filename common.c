@@ -35,6 +35,7 @@
 #include <err.h>
 #include <string.h>
 #include <setjmp.h>
+#include <pthread.h>
 
 #include <jpeglib.h>
 #include <jerror.h>
@@ -735,28 +736,34 @@ file_hasextension(char *name, char *ext)
 #define NBUCKETS	64
 
 u_char table[256];
+pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+/* Number of bits set in each byte; stegbreak calls is_random from threads */
+
+void
+is_random_init(void)
+{
+	int i;
+
+	table[0] = 0; table[1] = 1; table[2] = 1; table[3] = 2;
+	table[4] = 1; table[5] = 2; table[6] = 2; table[7] = 3;
+
+	for (i = 8; i < 16; i++)
+		table[i] = 1 + table[i & 0x7];
+	for (i = 16; i < 256; i++)
+		table[i] = table[(i >> 4) & 0xf] + table[i & 0xf];
+}
 
 int
 is_random(u_char *buf, int size)
 {
-	static int initalized;
 	u_char *p, val;
 	int bucket[NBUCKETS];
 	int i, j, one;
 	float tmp, sum, exp, ratio;
 
-	if (!initalized) {
-		table[0] = 0; table[1] = 1; table[2] = 1; table[3] = 2;
-		table[4] = 1; table[5] = 2; table[6] = 2; table[7] = 3;
-
-		for (i = 8; i < 16; i++)
-			table[i] = 1 + table[i & 0x7];
-		for (i = 16; i < 256; i++)
-			table[i] = table[(i >> 4) & 0xf] + table[i & 0xf];
+	pthread_once(&table_once, is_random_init);
 
-		initalized = 1;
-	}
-	
 	one = 0;
 	for (i = 0; i < size; i++)
 		one += table[buf[i]];
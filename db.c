@@ -30,32 +30,191 @@
 
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <err.h>
 
 #include "config.h"
 #include "db.h"
 
-extern int count;
+extern u_int32_t count;
 extern int found;
 
 struct dbqueue dblist;
+static int ntargets, ndone;
+
+/*
+ * The workers check the done flags and the counters for every group of
+ * words, so they read them without dbmtx.  Claiming a target in
+ * db_done() still takes the lock, so that only one worker reports it.
+ */
+#define DB_LOAD(x)	__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define DB_STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define DB_ADD(x, v)	__atomic_add_fetch(&(x), (v), __ATOMIC_RELEASE)
+static u_int32_t generation;	/* bumped when the targets are flushed */
+
+/* Groups of targets that share keys, hashed by their key material */
+#define DB_HASHSIZE	1024
+
+TAILQ_HEAD(dbgroupq, dbgroup);
+static struct dbgroupq dbgroups[DB_HASHSIZE];
+
+/* Constructors for the per worker state of each type */
+static void *(*state_new[DB_MAXTYPES])(void);
+static void (*state_free[DB_MAXTYPES])(void *);
+static int (*crack_lanes[DB_MAXTYPES])(char *, char **, int, void *, void *);
+static void (*report[DB_MAXTYPES])(char *, char *, void *, void *);
+
+static struct db_worker mainworker;
+
+/*
+ * With more than one worker, the words are handed out in batches.  The
+ * batches cycle between the free and the full queue; a single lock
+ * protects both and the claiming of found targets.  Found targets are
+ * only marked, since other workers may be walking the list; they are
+ * removed when the workers are idle in db_flush().  The crack functions
+ * do not print; a hit is reported only by the worker that marks it.
+ */
+
+#define DB_BATCH	256	/* multiple of DB_LANES */
+
+struct db_batch {
+	TAILQ_ENTRY(db_batch) next;
+	int n;
+	char words[DB_BATCH][DB_WORDLEN];
+};
+
+TAILQ_HEAD(db_batchq, db_batch);
+
+static struct db_batchq fullq, freeq;
+static struct db_batch *current;
+static pthread_t *workers;
+static int nworkers, busy, stopping;
+
+static pthread_mutex_t dbmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER;
+
+/* Serializes output and the magic tests */
+static pthread_mutex_t outmtx = PTHREAD_MUTEX_INITIALIZER;
 
 void
 db_init(void)
 {
+	int i;
+
 	TAILQ_INIT(&dblist);
+	for (i = 0; i < DB_HASHSIZE; i++)
+		TAILQ_INIT(&dbgroups[i]);
+	TAILQ_INIT(&fullq);
+	TAILQ_INIT(&freeq);
+}
+
+void
+db_lock(void)
+{
+	pthread_mutex_lock(&outmtx);
+}
+
+void
+db_unlock(void)
+{
+	pthread_mutex_unlock(&outmtx);
+}
+
+void
+db_register(int type, void *(*new)(void), void (*free)(void *),
+    int (*lanes)(char *, char **, int, void *, void *),
+    void (*print)(char *, char *, void *, void *))
+{
+	int i = ffs(type) - 1;
+
+	if (i < 0 || i >= DB_MAXTYPES)
+		errx(1, "%s: bad type %d", __func__, type);
+
+	state_new[i] = new;
+	state_free[i] = free;
+	crack_lanes[i] = lanes;
+	report[i] = print;
+}
+
+void *
+db_state(struct db_worker *worker, int type)
+{
+	int i = ffs(type) - 1;
+
+	if (worker->state[i] == NULL)
+		worker->state[i] = state_new[i]();
+
+	return (worker->state[i]);
+}
+
+void
+db_worker_free(struct db_worker *worker)
+{
+	int i;
+
+	for (i = 0; i < DB_MAXTYPES; i++) {
+		if (worker->state[i] != NULL)
+			state_free[i](worker->state[i]);
+		worker->state[i] = NULL;
+	}
+}
+
+struct dbgroup *
+db_group_find(int type, u_int32_t hash, void *obj,
+    int (*compare)(void *, void *))
+{
+	struct dbgroup *grp;
+
+	TAILQ_FOREACH(grp, &dbgroups[hash % DB_HASHSIZE], next)
+		if (grp->type == type && grp->hash == hash &&
+		    compare(grp->obj, obj) == 0)
+			return (grp);
+
+	return (NULL);
+}
+
+/*
+ * Without a hash, compare orders the targets of one type, e.g. JSteg
+ * images by the length of their data.  Targets of other types may be
+ * in between.  Usually the files come in order, so start at the tail.
+ */
+
+void
+db_insert_ordered(struct db *db)
+{
+	struct db *tmp, *first = NULL;
+
+	for (tmp = TAILQ_LAST(&dblist, dbqueue); tmp;
+	     tmp = TAILQ_PREV(tmp, dbqueue, next)) {
+		if (tmp->type != db->type)
+			continue;
+		if (db->compare(tmp->obj, db->obj) <= 0)
+			break;
+		first = tmp;
+	}
+
+	if (tmp != NULL)
+		TAILQ_INSERT_AFTER(&dblist, tmp, db, next);
+	else if (first != NULL)
+		TAILQ_INSERT_BEFORE(first, db, next);
+	else
+		TAILQ_INSERT_TAIL(&dblist, db, next);
 }
 
 void
 db_insert(char *filename, int type, void *obj,
-    int (*crack)(char *, char *, void *),
-    int (*compare)(void *, void *),
+    int (*crack)(char *, char *, void *, void *),
+    u_int32_t (*hash)(void *), int (*compare)(void *, void *),
     void (*free)(void *))
 {
-	struct db *db, *tmp;
+	struct dbgroup *grp;
+	struct db *db;
+	u_int32_t val;
 
 	if ((db = malloc(sizeof(struct db))) == NULL)
 		err(1, "malloc");
@@ -66,63 +225,357 @@ db_insert(char *filename, int type, void *obj,
 	db->type = type;
 	db->obj = obj;
 	db->crack = crack;
+	db->compare = compare;
 	db->free = free;
+	db->group = NULL;
+	db->done = 0;
 
-	if (compare != NULL) {
-		for (tmp = TAILQ_FIRST(&dblist); tmp;
-		     tmp = TAILQ_NEXT(tmp, next))
-			if (compare(db->obj, tmp->obj) <= 0)
-				break;
-		if (tmp)
-			TAILQ_INSERT_BEFORE(tmp, db, next);
+	DB_ADD(ntargets, 1);
+
+	if (hash == NULL) {
+		if (compare != NULL)
+			db_insert_ordered(db);
 		else
 			TAILQ_INSERT_TAIL(&dblist, db, next);
-	} else
-		TAILQ_INSERT_TAIL(&dblist, db, next);
+		return;
+	}
+
+	val = hash(obj);
+	if ((grp = db_group_find(type, val, obj, compare)) != NULL) {
+		TAILQ_INSERT_AFTER(&dblist, grp->last, db, next);
+		grp->last = db;
+		db->group = grp;
+		return;
+	}
+
+	if ((grp = malloc(sizeof(struct dbgroup))) == NULL)
+		err(1, "malloc");
+	grp->type = type;
+	grp->hash = val;
+	grp->obj = obj;
+	grp->last = db;
+	TAILQ_INSERT_TAIL(&dbgroups[val % DB_HASHSIZE], grp, next);
+
+	TAILQ_INSERT_TAIL(&dblist, db, next);
+	db->group = grp;
 }
 
 void
 db_remove(struct db *db)
 {
+	struct dbgroup *grp = db->group;
+	struct db *prev, *next;
+
+	/* Keep the group pointing at live members, or drop it */
+	if (grp != NULL) {
+		prev = TAILQ_PREV(db, dbqueue, next);
+		next = TAILQ_NEXT(db, next);
+		if (prev != NULL && prev->group != grp)
+			prev = NULL;
+		if (next != NULL && next->group != grp)
+			next = NULL;
+
+		if (prev == NULL && next == NULL) {
+			TAILQ_REMOVE(&dbgroups[grp->hash % DB_HASHSIZE],
+			    grp, next);
+			free(grp);
+		} else {
+			if (grp->last == db)
+				grp->last = prev;
+			if (grp->obj == db->obj)
+				grp->obj = next != NULL ? next->obj : prev->obj;
+		}
+	}
+
 	TAILQ_REMOVE(&dblist, db, next);
+	if (db->done)
+		DB_ADD(ndone, -1);
+	DB_ADD(ntargets, -1);
 
 	db->free(db->obj);
 	free(db->filename);
 	free(db);
 }
 
+/* Removes the targets that have been cracked */
+
+void
+db_reap(void)
+{
+	struct db *db, *next;
+
+	for (db = TAILQ_FIRST(&dblist); db; db = next) {
+		next = TAILQ_NEXT(db, next);
+		if (db->done)
+			db_remove(db);
+	}
+}
+
+int
+db_isdone(struct db *db)
+{
+	return (DB_LOAD(db->done));
+}
+
+/* Returns 1 once all targets have been cracked */
+
+int
+db_finished(void)
+{
+	return (DB_LOAD(ndone) == DB_LOAD(ntargets));
+}
+
+/* Marks a target as cracked, returns 1 if the caller got to it first */
+
+int
+db_done(struct db *db)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&dbmtx);
+	if (!db->done) {
+		DB_STORE(db->done, 1);
+		found++;
+		DB_ADD(ndone, 1);
+		res = 1;
+	}
+	pthread_mutex_unlock(&dbmtx);
+
+	return (res);
+}
+
+/*
+ * Tries at most DB_LANES words against all targets.  For each target,
+ * the first of these words that cracks it wins.  With several workers,
+ * a target is reported by the worker that marks it first.
+ */
+
+void
+db_crack_words(struct db_worker *worker, char **words, int n)
+{
+	int (*lanes)(char *, char **, int, void *, void *);
+	struct db *db;
+	void *state;
+	int i, t, hit;
+
+	for (db = TAILQ_FIRST(&dblist); db; db = TAILQ_NEXT(db, next)) {
+		if (db_isdone(db))
+			continue;
+
+		state = db_state(worker, db->type);
+		t = ffs(db->type) - 1;
+		lanes = crack_lanes[t];
+		if (lanes != NULL) {
+			worker->count += n;
+			hit = (*lanes)(db->filename, words, n, db->obj, state);
+		} else {
+			for (hit = -1, i = 0; i < n && hit == -1; i++) {
+				worker->count++;
+				if ((*db->crack)(db->filename, words[i],
+					db->obj, state))
+					hit = i;
+			}
+		}
+
+		if (hit != -1 && db_done(db)) {
+			db_lock();
+			report[t](db->filename, words[hit], db->obj, state);
+			db_unlock();
+		}
+	}
+}
+
+/* Cracks the words that the main thread has collected */
+
+void
+db_crack_main(void)
+{
+	char *words[DB_LANES];
+	int i;
+
+	for (i = 0; i < mainworker.nwords; i++)
+		words[i] = mainworker.words[i];
+
+	db_crack_words(&mainworker, words, mainworker.nwords);
+	mainworker.nwords = 0;
+	count += mainworker.count;
+	mainworker.count = 0;
+	if (ndone)
+		db_reap();
+}
+
+void *
+db_thread(void *arg)
+{
+	struct db_worker worker;
+	struct db_batch *batch;
+	char *words[DB_LANES];
+	int i, j, n;
+
+	memset(&worker, 0, sizeof(worker));
+
+	pthread_mutex_lock(&dbmtx);
+	for (;;) {
+		while (TAILQ_EMPTY(&fullq) && !stopping)
+			pthread_cond_wait(&workcond, &dbmtx);
+		if ((batch = TAILQ_FIRST(&fullq)) == NULL)
+			break;
+		TAILQ_REMOVE(&fullq, batch, next);
+		busy++;
+		pthread_mutex_unlock(&dbmtx);
+
+		for (i = 0; i < batch->n && !db_finished(); i += n) {
+			n = batch->n - i;
+			if (n > DB_LANES)
+				n = DB_LANES;
+			for (j = 0; j < n; j++)
+				words[j] = batch->words[i + j];
+			db_crack_words(&worker, words, n);
+		}
+
+		pthread_mutex_lock(&dbmtx);
+		count += worker.count;
+		worker.count = 0;
+		TAILQ_INSERT_TAIL(&freeq, batch, next);
+		busy--;
+		pthread_cond_broadcast(&donecond);
+	}
+	pthread_mutex_unlock(&dbmtx);
+
+	db_worker_free(&worker);
+
+	return (NULL);
+}
+
+void
+db_start(int n)
+{
+	struct db_batch *batch;
+	int i;
+
+	if (n <= 1)
+		return;
+
+	/* Two batches per worker keep everyone busy */
+	for (i = 0; i < 2 * n; i++) {
+		if ((batch = malloc(sizeof(struct db_batch))) == NULL)
+			err(1, "malloc");
+		TAILQ_INSERT_TAIL(&freeq, batch, next);
+	}
+
+	if ((workers = calloc(n, sizeof(pthread_t))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		if (pthread_create(&workers[i], NULL, db_thread, NULL) != 0)
+			err(1, "pthread_create");
+	nworkers = n;
+}
+
+void
+db_stop(void)
+{
+	struct db_batch *batch;
+	int i;
+
+	db_worker_free(&mainworker);
+	if (!nworkers)
+		return;
+
+	pthread_mutex_lock(&dbmtx);
+	stopping = 1;
+	pthread_cond_broadcast(&workcond);
+	pthread_mutex_unlock(&dbmtx);
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	nworkers = 0;
+
+	while ((batch = TAILQ_FIRST(&freeq)) != NULL) {
+		TAILQ_REMOVE(&freeq, batch, next);
+		free(batch);
+	}
+	free(current);
+	current = NULL;
+}
+
+void
+db_submit(void)
+{
+	pthread_mutex_lock(&dbmtx);
+	TAILQ_INSERT_TAIL(&fullq, current, next);
+	current = NULL;
+	pthread_cond_signal(&workcond);
+	pthread_mutex_unlock(&dbmtx);
+}
+
+/* Waits until all words have been tried */
+
+void
+db_drain(void)
+{
+	if (current != NULL && current->n)
+		db_submit();
+
+	pthread_mutex_lock(&dbmtx);
+	while (!TAILQ_EMPTY(&fullq) || busy)
+		pthread_cond_wait(&donecond, &dbmtx);
+	pthread_mutex_unlock(&dbmtx);
+}
+
+u_int32_t
+db_generation(void)
+{
+	return (generation);
+}
+
 void
 db_flush(void)
 {
 	struct db *db;
 	extern int quiet;
 
+	if (nworkers)
+		db_drain();
+	else if (mainworker.nwords)
+		db_crack_main();
+	db_reap();
+
 	for (db = TAILQ_FIRST(&dblist); db; db = TAILQ_FIRST(&dblist)) {
 		if (!quiet)
 			fprintf(stdout, "%s : negative\n", db->filename);
 		db_remove(db);
 	}
+
+	generation++;
 }
 
+/* Returns 1 once all targets have been cracked */
+
 int
 db_crack(char *word)
 {
-	struct db *db, *next;
-	int res;
+	if (!nworkers) {
+		strlcpy(mainworker.words[mainworker.nwords++], word,
+		    DB_WORDLEN);
+		if (mainworker.nwords == DB_LANES)
+			db_crack_main();
 
-	for(db = TAILQ_FIRST(&dblist); db; db = next) {
-		next = TAILQ_NEXT(db, next);
+		return (TAILQ_FIRST(&dblist) == NULL);
+	}
 
-		count++;
-		res = (*db->crack)(db->filename, word, db->obj);
-		if (res) {
-			found++;
-			db_remove(db);
-		}
+	if (current == NULL) {
+		pthread_mutex_lock(&dbmtx);
+		while ((current = TAILQ_FIRST(&freeq)) == NULL)
+			pthread_cond_wait(&donecond, &dbmtx);
+		TAILQ_REMOVE(&freeq, current, next);
+		pthread_mutex_unlock(&dbmtx);
+		current->n = 0;
 	}
 
-	if (TAILQ_FIRST(&dblist) == NULL)
-		return (1);
+	strlcpy(current->words[current->n++], word, DB_WORDLEN);
+	if (current->n == DB_BATCH)
+		db_submit();
 
-	return (0);
+	return (db_finished());
 }
@@ -34,25 +34,68 @@
 TAILQ_HEAD(dbqueue, db);
 extern struct dbqueue dblist;
 
+/*
+ * Targets whose objects compare equal share key schedules, e.g. JPHide
+ * images with the same IV.  They are kept next to each other in dblist,
+ * so that a crack function computes the keys once for the whole group.
+ */
+struct dbgroup {
+	TAILQ_ENTRY (dbgroup) next;	/* hash chain */
+
+	int type;
+	u_int32_t hash;
+	void *obj;			/* of the first member */
+	struct db *last;		/* new members go after it */
+};
+
 struct db {
 	TAILQ_ENTRY (db) next;
 
 	int type;
 	char *filename;
 	void *obj;
-	int (*crack)(char *, char *, void *);
+	int (*crack)(char *, char *, void *, void *);
 	int (*compare)(void *, void *);
 	void (*free)(void *);
+
+	struct dbgroup *group;
+	int done;		/* cracked, removed by the next flush */
+};
+
+/*
+ * The crack functions cache key schedules for the last word in a
+ * state object.  Each worker has one for every type of target.
+ * Words are tried in groups of DB_LANES, so that types with a
+ * crack_lanes function can compute several key schedules at once.
+ */
+#define DB_MAXTYPES	8
+#define DB_LANES	4
+#define DB_WORDLEN	128	/* RULE_WORD_SIZE */
+
+struct db_worker {
+	void *state[DB_MAXTYPES];
+	u_int32_t count;
+
+	char words[DB_LANES][DB_WORDLEN];
+	int nwords;
 };
 
 void db_init(void);
+void db_register(int type, void *(*)(void), void (*)(void *),
+    int (*)(char *, char **, int, void *, void *),
+    void (*)(char *, char *, void *, void *));
+void db_start(int);
+void db_stop(void);
 void db_insert(char *filename, int type, void *obj,
-    int (*crack)(char *, char *, void *),
-    int (*compare)(void *, void *),
+    int (*crack)(char *, char *, void *, void *),
+    u_int32_t (*hash)(void *), int (*compare)(void *, void *),
     void (*free)(void *));
 int db_crack(char *);
 void db_remove(struct db *db);
 void db_flush(void);
+u_int32_t db_generation(void);
 
-#endif /* _DB_H_ */
+void db_lock(void);
+void db_unlock(void);
 
+#endif /* _DB_H_ */
@@ -30,14 +30,20 @@
 
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <err.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <md5.h>
 
 #include <jpeglib.h>
 
@@ -46,13 +52,26 @@
 #include "extraction.h"
 #include "discrimination.h"
 
-struct cd_entry {
-	TAILQ_ENTRY(cd_entry) next;
+/* Feature vectors of one class, stored as a row-major matrix */
+struct cd_set {
+	double *points;		/* n rows of npoints values */
+	char **filenames;
+	int n;
+	int size;		/* allocated rows */
+};
 
-	char *filename;
-	int positive;
-	int npoints;
-	double *points;
+/*
+ * Running statistics of one class for training without keeping the
+ * feature vectors.  Rows are collected in a block that is merged into
+ * the count, mean and co-moments with the update by Chan et al.  Only
+ * the upper triangle of the co-moment matrix is maintained.
+ */
+struct cd_accum {
+	double n;
+	double *mean;
+	double *comoment;	/* npoints x npoints */
+	double *block;		/* rows not merged yet */
+	int nblock;
 };
 
 struct cd_decision {
@@ -66,25 +85,95 @@ struct cd_decision {
 	double where;	/* parameter from testing */
 	double projpos;
 	double projneg;
+	double score;	/* from the last cd_group_score() */
 
-	TAILQ_HEAD(cd_list, cd_entry) positiveq;
-	int npositive;
+	struct cd_set positive;
+	struct cd_set negative;
 
-	struct cd_list negativeq;
-	int nnegative;
+	int online;	/* only keeps the statistics below */
+	struct cd_accum accpos;
+	struct cd_accum accneg;
 
 	char *transform_name;
 	transform_t transform;
+
+	int mapped;	/* name, transform_name and b are in a mapping */
+};
+
+/*
+ * Binary decision object.  It is used directly from a mapping of the
+ * file, so all values are in host byte order.  The projection vector
+ * follows the header.
+ */
+
+#define CD_BIN_MAGIC	"STEGCD\n"
+#define CD_BIN_VERSION	1
+#define CD_BIN_ORDER	0x01020304
+#define CD_NAMELEN	128
+#define CD_TFNAMELEN	32
+
+struct cd_binhdr {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t byteorder;
+	u_int32_t npoints;
+	u_int32_t reserved;
+	u_char digest[16];	/* MD5 over the file with a zero digest */
+	char name[CD_NAMELEN];
+	char transform[CD_TFNAMELEN];
+	double projpos;
+	double projneg;
+	double k;
+};
+
+/*
+ * Training state of an online decision, so that shards can be trained
+ * separately and merged later.  The header is followed by the mean and
+ * co-moment matrix of the positive and then the negative class.
+ */
+
+#define CD_ST_MAGIC	"STEGCS\n"
+#define CD_ST_VERSION	1
+
+struct cd_sthdr {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t byteorder;
+	u_int32_t npoints;
+	u_int32_t reserved;
+	char transform[CD_TFNAMELEN];
+	double npositive;
+	double nnegative;
 };
 
 static TAILQ_HEAD(cdqueue, cd_decision) cdq;
 
+/*
+ * Decisions that use the same transform are scored together.  Their
+ * projection vectors are the rows of one weight matrix, so a feature
+ * vector is read once for all of them.
+ */
+struct cd_group {
+	TAILQ_ENTRY(cd_group) next;
+	transform_t transform;
+	int npoints;
+
+	int nmodels;
+	struct cd_decision **models;
+	double *weights;	/* nmodels x npoints */
+	double *scale;		/* 1 / (projpos - projneg) per model */
+	double *scores;
+};
+
+static TAILQ_HEAD(cdgroups, cd_group) cdgroups;
+
 #define CD_PERCENT	(0.8)
 
 void
 cd_init(void)
 {
 	TAILQ_INIT(&cdq);
+	TAILQ_INIT(&cdgroups);
 }
 
 void
@@ -109,9 +198,6 @@ cd_new(void)
 	if ((cdd = calloc(1, sizeof(struct cd_decision))) == NULL)
 		err(1, "calloc");
 
-	TAILQ_INIT(&cdd->positiveq);
-	TAILQ_INIT(&cdd->negativeq);
-
 	return (cdd);
 }
 
@@ -151,42 +237,277 @@ cd_collect_data(char *data, int *pnpoints)
 	return (ppoints);
 }
 
+void
+cd_online(struct cd_decision *cdd)
+{
+	cdd->online = 1;
+	cdd->where = 0.5;	/* nothing to test with */
+}
+
+void cd_accum_add(struct cd_accum *, double *, int);
+
 void
 cd_make_entry(struct cd_decision *cdd, char *name, int positive,
     double *points, int npoints)
 {
-	struct cd_entry *entry;
+	struct cd_set *set = positive ? &cdd->positive : &cdd->negative;
 
-	if ((entry = calloc(1, sizeof(struct cd_entry))) == NULL)
-		err(1, "calloc");
+	if (cdd->online) {
+		cd_accum_add(positive ? &cdd->accpos : &cdd->accneg,
+		    points, npoints);
+		return;
+	}
+
+	if (set->n >= set->size) {
+		int size = set->size ? set->size * 2 : 256;
+		double *newpoints;
+		char **newnames;
+
+		newpoints = realloc(set->points,
+		    (size_t)size * npoints * sizeof(double));
+		newnames = realloc(set->filenames, size * sizeof(char *));
+		if (newpoints == NULL || newnames == NULL)
+			err(1, "realloc");
+		set->points = newpoints;
+		set->filenames = newnames;
+		set->size = size;
+	}
+
+	if ((set->filenames[set->n] = strdup(name)) == NULL)
+		err(1, "strdup");
+	memcpy(set->points + (size_t)set->n * npoints, points,
+	    npoints * sizeof(double));
+	set->n++;
+}
 
-	if ((entry->filename = strdup(name)) == NULL)
+/*
+ * Binary feature store written by stegdetect -C.  The header is
+ * followed by three sections: the feature vectors as a row-major
+ * matrix of doubles, one int32 label per row, and the image names
+ * separated by NUL characters.  All values are in host byte order.
+ */
+
+#define CD_FS_MAGIC	"STEGCF\n"
+#define CD_FS_VERSION	1
+
+struct cd_fshdr {
+	char magic[8];
+	u_int32_t version;
+	u_int32_t byteorder;
+	u_int32_t npoints;
+	u_int32_t reserved;
+	u_int64_t nrows;
+	u_int64_t namesize;	/* bytes in the name section */
+	char transform[CD_TFNAMELEN];
+};
+
+struct cd_features {
+	FILE *fout;
+	char *filename;
+	struct cd_fshdr hdr;
+
+	int32_t *labels;
+	char *names;
+	size_t nlabels, labelalloc;
+	size_t namesize, namealloc;
+};
+
+struct cd_features *
+cd_features_open(char *filename, char *transform_name)
+{
+	struct cd_features *cf;
+
+	if ((cf = calloc(1, sizeof(struct cd_features))) == NULL)
+		err(1, "calloc");
+	if ((cf->filename = strdup(filename)) == NULL)
 		err(1, "strdup");
-	entry->positive = positive;
-	entry->points = points;
-	entry->npoints = npoints;
+	if ((cf->fout = fopen(filename, "w")) == NULL)
+		err(1, "fopen: %s", filename);
+
+	memcpy(cf->hdr.magic, CD_FS_MAGIC, sizeof(cf->hdr.magic));
+	cf->hdr.version = CD_FS_VERSION;
+	cf->hdr.byteorder = CD_BIN_ORDER;
+	if (strlcpy(cf->hdr.transform, transform_name,
+		sizeof(cf->hdr.transform)) >= sizeof(cf->hdr.transform))
+		errx(1, "%s: transform name too long", transform_name);
 
-	if (positive) {
-		TAILQ_INSERT_TAIL(&cdd->positiveq, entry, next);
-		cdd->npositive++;
+	/* Filled in by cd_features_close() */
+	if (fwrite(&cf->hdr, sizeof(cf->hdr), 1, cf->fout) != 1)
+		err(1, "fwrite: %s", filename);
+
+	return (cf);
+}
+
+/* Feature vectors go straight to the file, labels and names are kept */
+
+void
+cd_features_add(struct cd_features *cf, char *imagename, int positive,
+    double *points, int npoints)
+{
+	size_t len = strlen(imagename) + 1;
+
+	if (cf->hdr.nrows == 0)
+		cf->hdr.npoints = npoints;
+	else if (cf->hdr.npoints != npoints)
+		errx(1, "%s: require %d data points but got %d",
+		    imagename, cf->hdr.npoints, npoints);
+
+	if (fwrite(points, sizeof(double), npoints, cf->fout) != npoints)
+		err(1, "fwrite: %s", cf->filename);
+
+	if (cf->nlabels >= cf->labelalloc) {
+		size_t size = cf->labelalloc ? cf->labelalloc * 2 : 256;
+		int32_t *newlabels;
+
+		newlabels = realloc(cf->labels, size * sizeof(int32_t));
+		if (newlabels == NULL)
+			err(1, "realloc");
+		cf->labels = newlabels;
+		cf->labelalloc = size;
+	}
+	cf->labels[cf->nlabels++] = positive;
+
+	if (cf->namesize + len > cf->namealloc) {
+		size_t size = cf->namealloc ? cf->namealloc * 2 : 8192;
+		char *newnames;
+
+		while (size < cf->namesize + len)
+			size *= 2;
+		if ((newnames = realloc(cf->names, size)) == NULL)
+			err(1, "realloc");
+		cf->names = newnames;
+		cf->namealloc = size;
+	}
+	memcpy(cf->names + cf->namesize, imagename, len);
+	cf->namesize += len;
+
+	cf->hdr.nrows++;
+}
+
+void
+cd_features_close(struct cd_features *cf)
+{
+	FILE *fout = cf->fout;
+
+	cf->hdr.namesize = cf->namesize;
+
+	if (fwrite(cf->labels, sizeof(int32_t), cf->nlabels, fout) !=
+	    cf->nlabels ||
+	    fwrite(cf->names, 1, cf->namesize, fout) != cf->namesize)
+		err(1, "fwrite: %s", cf->filename);
+
+	if (fseek(fout, 0, SEEK_SET) == -1 ||
+	    fwrite(&cf->hdr, sizeof(cf->hdr), 1, fout) != 1 ||
+	    fclose(fout) == EOF)
+		err(1, "%s", cf->filename);
+
+	free(cf->labels);
+	free(cf->names);
+	free(cf->filename);
+	free(cf);
+}
+
+/* Maps a feature store and adds its rows without any parsing */
+
+int
+cd_process_binary(struct cd_decision *cdd, char *filename, FILE *fin)
+{
+	struct cd_fshdr *hdr;
+	struct stat st;
+	double *points;
+	int32_t *labels;
+	char *names, *end;
+	u_int64_t i, avail, rowsize;
+	void *p;
+
+	if (fstat(fileno(fin), &st) == -1)
+		err(1, "fstat: %s", filename);
+	if (st.st_size < sizeof(*hdr))
+		errx(1, "\"%s\": truncated feature store", filename);
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fin), 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap: %s", filename);
+	hdr = p;
+
+	if (hdr->version != CD_FS_VERSION || hdr->byteorder != CD_BIN_ORDER)
+		errx(1, "\"%s\": version %d or different byte order",
+		    filename, hdr->version);
+
+	/* Bound each header field by the file size before multiplying */
+	avail = st.st_size - sizeof(*hdr);
+	rowsize = (u_int64_t)hdr->npoints * sizeof(double) + sizeof(int32_t);
+	if (hdr->npoints > INT_MAX || hdr->namesize > avail ||
+	    hdr->nrows > (avail - hdr->namesize) / rowsize ||
+	    hdr->nrows * rowsize != avail - hdr->namesize ||
+	    memchr(hdr->transform, '\0', sizeof(hdr->transform)) == NULL)
+		errx(1, "\"%s\": malformed feature store", filename);
+
+	if (cdd->transform_name != NULL) {
+		if (strcmp(cdd->transform_name, hdr->transform))
+			errx(1, "\"%s\": transform name changed", filename);
 	} else {
-		TAILQ_INSERT_TAIL(&cdd->negativeq, entry, next);
-		cdd->nnegative++;
+		cdd->transform = transform_lookup(hdr->transform);
+		if (cdd->transform == NULL)
+			errx(1, "\"%s\": unknown transform", filename);
+		if ((cdd->transform_name = strdup(hdr->transform)) == NULL)
+			err(1, "strdup");
+	}
+
+	if (cdd->npoints && cdd->npoints != hdr->npoints)
+		errx(1, "\"%s\": require %d data points but got %d",
+		    filename, cdd->npoints, hdr->npoints);
+	cdd->npoints = hdr->npoints;
+
+	points = (double *)(hdr + 1);
+	labels = (int32_t *)(points + hdr->nrows * hdr->npoints);
+	names = (char *)(labels + hdr->nrows);
+	end = names + hdr->namesize;
+
+	for (i = 0; i < hdr->nrows; i++) {
+		if (names >= end || memchr(names, '\0', end - names) == NULL)
+			errx(1, "\"%s\": bad image names", filename);
+
+		cd_make_entry(cdd, names, labels[i],
+		    points + i * hdr->npoints, hdr->npoints);
+		names += strlen(names) + 1;
 	}
+
+	munmap(p, st.st_size);
+
+	return (0);
 }
 
+void cd_process_state(struct cd_decision *, char *, FILE *);
+
 int
 cd_process_file(struct cd_decision *cdd, char *filename)
 {
 	FILE *fin;
 	char line[2048], *p;
 	char *imagename, *type, *tfname, *tmp, *data;
+	char magic[sizeof(CD_FS_MAGIC) - 1];
 	double *points;
 	int linenr = 0, npoints = 0, tmpnpoints;
 
 	if ((fin = fopen(filename, "r")) == NULL)
 		err(1, "fopen: %s", filename);
 
+	if (fread(magic, sizeof(magic), 1, fin) == 1) {
+		if (!memcmp(magic, CD_FS_MAGIC, sizeof(magic))) {
+			cd_process_binary(cdd, filename, fin);
+			fclose(fin);
+			return (0);
+		}
+		if (!memcmp(magic, CD_ST_MAGIC, sizeof(magic))) {
+			rewind(fin);
+			cd_process_state(cdd, filename, fin);
+			fclose(fin);
+			return (0);
+		}
+	}
+	rewind(fin);
+
 	if (cdd->npoints)
 		npoints = cdd->npoints;
 
@@ -230,81 +551,441 @@ cd_process_file(struct cd_decision *cdd, char *filename)
 			errx(1, "\"%s\": require %d data points but got %d in line %d",
 			    filename, npoints, tmpnpoints, linenr);
 		if (!npoints)
-			npoints = tmpnpoints;
+			npoints = cdd->npoints = tmpnpoints;
 
 		cd_make_entry(cdd, imagename, atoi(type), points, npoints);
+		free(points);
 	}
 
 	fclose(fin);
 
-	if (!cdd->npoints)
-		cdd->npoints = npoints;
-
 	return (0);
 }
 
 void
-cd_meanest(struct cd_list *head, int howmany, double *mest, int mestsize)
+cd_meanest(struct cd_set *set, int howmany, double *mest, int mestsize)
 {
-	int i;
-	struct cd_entry *tmp;
+	double *row;
+	int i, j;
 
-	for (i = 0; i < mestsize; i++) {
-		int count = 0;
-		double mean = 0;
+	if (!howmany || howmany > set->n)
+		howmany = set->n;
 
-		TAILQ_FOREACH(tmp, head, next) {
-			mean += tmp->points[i];
-			count++;
+	for (i = 0; i < mestsize; i++)
+		mest[i] = 0;
 
-			if (howmany && count >= howmany)
-				break;
-		}
+	for (j = 0, row = set->points; j < howmany; j++, row += mestsize)
+		for (i = 0; i < mestsize; i++)
+			mest[i] += row[i];
+
+	for (i = 0; i < mestsize; i++)
+		mest[i] /= howmany;
+}
+
+/*
+ * The covariance estimate is a sum of rank-1 updates with the
+ * centered feature vectors.  The rows are split between threads, each
+ * one accumulates its own upper triangle.  Within a thread, rows are
+ * centered in blocks and the update is done in tiles of the matrix
+ * to stay in cache.
+ */
+
+#define CD_ROWBLOCK	64
+#define CD_TILE		64
+#define CD_MINROWS	1024	/* rows per thread */
+#define CD_MAXTHREADS	32
+
+struct cd_covarjob {
+	pthread_t tid;
+	int npoints;
+	double *points[2];	/* first row of each class */
+	int nrows[2];
+	double *mean[2];
+	double *covar;		/* partial sums */
+};
 
-		mest[i] = mean / count;
+void
+cd_covarsum(double *points, int nrows, double *mean, int npoints,
+    double *covar, double *buf)
+{
+	int r, i, j, row, nblock, it, jt, iend, jend;
+	double a, *y, *c;
+
+	for (row = 0; row < nrows; row += CD_ROWBLOCK) {
+		nblock = nrows - row;
+		if (nblock > CD_ROWBLOCK)
+			nblock = CD_ROWBLOCK;
+
+		y = points + (size_t)row * npoints;
+		for (r = 0; r < nblock; r++)
+			for (i = 0; i < npoints; i++)
+				buf[r * npoints + i] =
+				    y[r * npoints + i] - mean[i];
+
+		for (it = 0; it < npoints; it += CD_TILE) {
+			iend = it + CD_TILE < npoints ? it + CD_TILE : npoints;
+			for (jt = it; jt < npoints; jt += CD_TILE) {
+				jend = jt + CD_TILE < npoints ?
+				    jt + CD_TILE : npoints;
+				for (r = 0; r < nblock; r++) {
+					y = buf + r * npoints;
+					for (i = it; i < iend; i++) {
+						a = y[i];
+						c = covar + (size_t)i * npoints;
+						for (j = i > jt ? i : jt;
+						    j < jend; j++)
+							c[j] += a * y[j];
+					}
+				}
+			}
+		}
 	}
 }
 
+void *
+cd_covarthread(void *arg)
+{
+	struct cd_covarjob *job = arg;
+	double *buf;
+	int i;
+
+	buf = malloc(CD_ROWBLOCK * job->npoints * sizeof(double));
+	if (buf == NULL)
+		err(1, "malloc");
+
+	for (i = 0; i < 2; i++)
+		cd_covarsum(job->points[i], job->nrows[i], job->mean[i],
+		    job->npoints, job->covar, buf);
+
+	free(buf);
+
+	return (NULL);
+}
+
 /* Compute the estimator for the covariance matrix */
 
 void
 cd_covarest(struct cd_decision *cdd, int npositive, int nnegative,
-    double *mestpos, double *mestneg, double **covarest)
+    double *mestpos, double *mestneg, double *covarest)
 {
-	int i, j;
+	struct cd_covarjob jobs[CD_MAXTHREADS], *job;
+	struct cd_set *set[2];
+	int count[2];
+	double *mean[2];
+	int i, j, k, t, nthreads, start, end;
 	int npoints = cdd->npoints;
-	struct cd_entry *tmp;
+	long ncpu;
+
+	set[0] = &cdd->positive;
+	set[1] = &cdd->negative;
+	count[0] = npositive && npositive < set[0]->n ? npositive : set[0]->n;
+	count[1] = nnegative && nnegative < set[1]->n ? nnegative : set[1]->n;
+	mean[0] = mestpos;
+	mean[1] = mestneg;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = (count[0] + count[1]) / CD_MINROWS;
+	if (nthreads > ncpu)
+		nthreads = ncpu;
+	if (nthreads > CD_MAXTHREADS)
+		nthreads = CD_MAXTHREADS;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	for (t = 0; t < nthreads; t++) {
+		job = &jobs[t];
+		job->npoints = npoints;
+		for (k = 0; k < 2; k++) {
+			start = (long)count[k] * t / nthreads;
+			end = (long)count[k] * (t + 1) / nthreads;
+			job->points[k] = set[k]->points +
+			    (size_t)start * npoints;
+			job->nrows[k] = end - start;
+			job->mean[k] = mean[k];
+		}
+		job->covar = calloc((size_t)npoints * npoints, sizeof(double));
+		if (job->covar == NULL)
+			err(1, "calloc");
+	}
+
+	for (t = 1; t < nthreads; t++) {
+		if (pthread_create(&jobs[t].tid, NULL,
+			cd_covarthread, &jobs[t]) != 0)
+			err(1, "pthread_create");
+	}
+	cd_covarthread(&jobs[0]);
+
+	memcpy(covarest, jobs[0].covar,
+	    (size_t)npoints * npoints * sizeof(double));
+	for (t = 1; t < nthreads; t++) {
+		pthread_join(jobs[t].tid, NULL);
+		for (i = 0; i < npoints * npoints; i++)
+			covarest[i] += jobs[t].covar[i];
+	}
+	for (t = 0; t < nthreads; t++)
+		free(jobs[t].covar);
 
 	for (i = 0; i < npoints; i++) {
-		for (j = 0; j < npoints; j++) {
-			double sum1, sum2;
-			int count1, count2;
-
-			sum1 = 0;
-			count1 = 0;
-			TAILQ_FOREACH(tmp, &cdd->positiveq, next) {
-				sum1 += (tmp->points[i] - mestpos[i]) *
-				    (tmp->points[j] - mestpos[j]);
-				count1++;
-				if (npositive && count1 >= npositive)
-					break;
-			}
+		for (j = i; j < npoints; j++) {
+			covarest[i * npoints + j] /= count[0] + count[1] - 2;
+			covarest[j * npoints + i] = covarest[i * npoints + j];
+		}
+	}
+}
 
-			sum2 = 0;
-			count2 = 0;
-			TAILQ_FOREACH(tmp, &cdd->negativeq, next) {
-				sum1 += (tmp->points[i] - mestneg[i]) *
-				    (tmp->points[j] - mestneg[j]);
-				count2++;
-				if (nnegative && count2 >= nnegative)
-					break;
-			}
+#define CD_ACCBLOCK	1024	/* rows merged at once */
+
+void
+cd_accum_init(struct cd_accum *acc, int npoints)
+{
+	acc->mean = calloc(npoints, sizeof(double));
+	acc->comoment = calloc((size_t)npoints * npoints, sizeof(double));
+	if (acc->mean == NULL || acc->comoment == NULL)
+		err(1, "calloc");
+}
+
+void
+cd_accum_free(struct cd_accum *acc)
+{
+	free(acc->mean);
+	free(acc->comoment);
+	free(acc->block);
+	memset(acc, 0, sizeof(*acc));
+}
+
+/* Sets the statistics to those of nrows contiguous rows */
+
+void
+cd_accum_rows(struct cd_accum *acc, double *points, int nrows, int npoints)
+{
+	struct cd_set set;
+	double *buf;
+
+	memset(acc->comoment, 0, (size_t)npoints * npoints * sizeof(double));
+	memset(acc->mean, 0, npoints * sizeof(double));
+	acc->n = nrows;
+	if (nrows == 0)
+		return;
+
+	buf = malloc(CD_ROWBLOCK * npoints * sizeof(double));
+	if (buf == NULL)
+		err(1, "malloc");
+
+	memset(&set, 0, sizeof(set));
+	set.points = points;
+	set.n = nrows;
+	cd_meanest(&set, nrows, acc->mean, npoints);
+	cd_covarsum(points, nrows, acc->mean, npoints, acc->comoment, buf);
+
+	free(buf);
+}
+
+/* Merges a partial result with n rows into the running statistics */
+
+void
+cd_accum_merge(struct cd_accum *acc, double n, double *mean,
+    double *comoment, int npoints)
+{
+	double total, f, *delta;
+	int i, j;
+
+	if (n == 0)
+		return;
+
+	if ((delta = malloc(npoints * sizeof(double))) == NULL)
+		err(1, "malloc");
+
+	total = acc->n + n;
+	f = acc->n * n / total;
+	for (i = 0; i < npoints; i++)
+		delta[i] = mean[i] - acc->mean[i];
+
+	for (i = 0; i < npoints; i++)
+		for (j = i; j < npoints; j++)
+			acc->comoment[i * npoints + j] +=
+			    comoment[i * npoints + j] + delta[i] * delta[j] * f;
+	for (i = 0; i < npoints; i++)
+		acc->mean[i] += delta[i] * n / total;
+	acc->n = total;
+
+	free(delta);
+}
+
+void
+cd_accum_flush(struct cd_accum *acc, int npoints)
+{
+	struct cd_accum part;
+
+	if (acc->nblock == 0)
+		return;
 
-			covarest[i][j] = (sum1 + sum2) / (count1 + count2 - 2);
+	memset(&part, 0, sizeof(part));
+	cd_accum_init(&part, npoints);
+	cd_accum_rows(&part, acc->block, acc->nblock, npoints);
+	cd_accum_merge(acc, part.n, part.mean, part.comoment, npoints);
+	cd_accum_free(&part);
+
+	acc->nblock = 0;
+}
+
+void
+cd_accum_add(struct cd_accum *acc, double *points, int npoints)
+{
+	if (acc->mean == NULL)
+		cd_accum_init(acc, npoints);
+	if (acc->block == NULL) {
+		acc->block = malloc((size_t)CD_ACCBLOCK * npoints *
+		    sizeof(double));
+		if (acc->block == NULL)
+			err(1, "malloc");
+	}
+
+	memcpy(acc->block + (size_t)acc->nblock * npoints, points,
+	    npoints * sizeof(double));
+	if (++acc->nblock == CD_ACCBLOCK)
+		cd_accum_flush(acc, npoints);
+}
+
+void
+cd_dump_state(FILE *fout, struct cd_decision *cdd)
+{
+	struct cd_sthdr hdr;
+	struct cd_accum *acc[2];
+	size_t npoints = cdd->npoints;
+	int i;
+
+	if (!cdd->online || !npoints)
+		errx(1, "No online training data");
+	if (strlen(cdd->transform_name) >= sizeof(hdr.transform))
+		errx(1, "%s: transform name too long", cdd->transform_name);
+
+	/* A shard may contain only one of the classes */
+	acc[0] = &cdd->accpos;
+	acc[1] = &cdd->accneg;
+	for (i = 0; i < 2; i++) {
+		if (acc[i]->mean == NULL)
+			cd_accum_init(acc[i], npoints);
+		cd_accum_flush(acc[i], npoints);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CD_ST_MAGIC, sizeof(hdr.magic));
+	hdr.version = CD_ST_VERSION;
+	hdr.byteorder = CD_BIN_ORDER;
+	hdr.npoints = npoints;
+	strlcpy(hdr.transform, cdd->transform_name, sizeof(hdr.transform));
+	hdr.npositive = acc[0]->n;
+	hdr.nnegative = acc[1]->n;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fout) != 1)
+		err(1, "fwrite");
+	for (i = 0; i < 2; i++) {
+		if (fwrite(acc[i]->mean, sizeof(double), npoints,
+			fout) != npoints ||
+		    fwrite(acc[i]->comoment, sizeof(double), npoints * npoints,
+			fout) != npoints * npoints)
+			err(1, "fwrite");
+	}
+}
+
+/* Merges a saved training state into an online decision */
+
+void
+cd_process_state(struct cd_decision *cdd, char *filename, FILE *fin)
+{
+	struct cd_sthdr hdr;
+	struct cd_accum *acc[2];
+	double n[2], *mean, *comoment;
+	size_t npoints;
+	int i;
+
+	if (!cdd->online)
+		errx(1, "\"%s\": training state requires online training",
+		    filename);
+
+	if (fread(&hdr, sizeof(hdr), 1, fin) != 1)
+		errx(1, "\"%s\": truncated training state", filename);
+	if (hdr.version != CD_ST_VERSION || hdr.byteorder != CD_BIN_ORDER)
+		errx(1, "\"%s\": version %d or different byte order",
+		    filename, hdr.version);
+	if (memchr(hdr.transform, '\0', sizeof(hdr.transform)) == NULL ||
+	    hdr.npoints == 0 || hdr.npoints > MAX_NPOINTS)
+		errx(1, "\"%s\": malformed training state", filename);
+
+	if (cdd->transform_name != NULL) {
+		if (strcmp(cdd->transform_name, hdr.transform))
+			errx(1, "\"%s\": transform name changed", filename);
+	} else {
+		cdd->transform = transform_lookup(hdr.transform);
+		if (cdd->transform == NULL)
+			errx(1, "\"%s\": unknown transform", filename);
+		if ((cdd->transform_name = strdup(hdr.transform)) == NULL)
+			err(1, "strdup");
+	}
+
+	if (cdd->npoints && cdd->npoints != hdr.npoints)
+		errx(1, "\"%s\": require %d data points but got %d",
+		    filename, cdd->npoints, hdr.npoints);
+	cdd->npoints = npoints = hdr.npoints;
+
+	mean = malloc(npoints * sizeof(double));
+	comoment = malloc(npoints * npoints * sizeof(double));
+	if (mean == NULL || comoment == NULL)
+		err(1, "malloc");
+
+	acc[0] = &cdd->accpos;
+	acc[1] = &cdd->accneg;
+	n[0] = hdr.npositive;
+	n[1] = hdr.nnegative;
+	for (i = 0; i < 2; i++) {
+		if (fread(mean, sizeof(double), npoints, fin) != npoints ||
+		    fread(comoment, sizeof(double), npoints * npoints,
+			fin) != npoints * npoints)
+			errx(1, "\"%s\": truncated training state", filename);
+		if (acc[i]->mean == NULL)
+			cd_accum_init(acc[i], npoints);
+		cd_accum_merge(acc[i], n[i], mean, comoment, npoints);
+	}
+
+	free(comoment);
+	free(mean);
+}
+
+/* Turns the online statistics into means and a covariance estimate */
+
+void
+cd_accum_covar(struct cd_accum *pos, struct cd_accum *neg, int npoints,
+    double *covarest)
+{
+	int i, j;
+	double n;
+
+	n = pos->n + neg->n - 2;
+	for (i = 0; i < npoints; i++) {
+		for (j = i; j < npoints; j++) {
+			covarest[i * npoints + j] =
+			    (pos->comoment[i * npoints + j] +
+				neg->comoment[i * npoints + j]) / n;
+			covarest[j * npoints + i] = covarest[i * npoints + j];
 		}
 	}
 }
 
+void
+cd_accum_estimate(struct cd_decision *cdd, double *mestpos,
+    double *mestneg, double *covarest)
+{
+	int npoints = cdd->npoints;
+
+	cd_accum_flush(&cdd->accpos, npoints);
+	cd_accum_flush(&cdd->accneg, npoints);
+
+	memcpy(mestpos, cdd->accpos.mean, npoints * sizeof(double));
+	memcpy(mestneg, cdd->accneg.mean, npoints * sizeof(double));
+
+	cd_accum_covar(&cdd->accpos, &cdd->accneg, npoints, covarest);
+}
+
 double
 cd_project(double *a, double *b, int npoints)
 {
@@ -332,12 +1013,138 @@ cd_dump(FILE *fout, struct cd_decision *cdd)
 	fprintf(fout, "%f %f %f\n", cdd->projpos, cdd->projneg, cdd->k);
 }
 
+void
+cd_bindigest(struct cd_binhdr *hdr, double *b, u_char *digest)
+{
+	MD5_CTX ctx;
+	u_char zero[sizeof(hdr->digest)];
+	size_t off = offsetof(struct cd_binhdr, digest);
+
+	memset(zero, 0, sizeof(zero));
+
+	/* The digest field itself counts as zero */
+	MD5Init(&ctx);
+	MD5Update(&ctx, (u_char *)hdr, off);
+	MD5Update(&ctx, zero, sizeof(zero));
+	MD5Update(&ctx, (u_char *)hdr + off + sizeof(zero),
+	    sizeof(*hdr) - off - sizeof(zero));
+	MD5Update(&ctx, (u_char *)b, hdr->npoints * sizeof(double));
+	MD5Final(digest, &ctx);
+}
+
+void
+cd_dump_binary(FILE *fout, struct cd_decision *cdd)
+{
+	struct cd_binhdr hdr;
+
+	if (strlen(cdd->name) >= sizeof(hdr.name) ||
+	    strlen(cdd->transform_name) >= sizeof(hdr.transform))
+		errx(1, "%s: name too long for binary format", cdd->name);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CD_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = CD_BIN_VERSION;
+	hdr.byteorder = CD_BIN_ORDER;
+	hdr.npoints = cdd->npoints;
+	strlcpy(hdr.name, cdd->name, sizeof(hdr.name));
+	strlcpy(hdr.transform, cdd->transform_name, sizeof(hdr.transform));
+	hdr.projpos = cdd->projpos;
+	hdr.projneg = cdd->projneg;
+	hdr.k = cdd->k;
+
+	cd_bindigest(&hdr, cdd->b, hdr.digest);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fout) != 1 ||
+	    fwrite(cdd->b, sizeof(double), cdd->npoints, fout) != cdd->npoints)
+		err(1, "fwrite");
+}
+
+/* Maps a binary decision object, nothing needs to be parsed */
+
+struct cd_decision *
+cd_read_binary(FILE *fin)
+{
+	struct cd_decision *cdd;
+	struct cd_binhdr *hdr;
+	struct stat st;
+	u_char digest[16];
+	void *p;
+
+	if (fstat(fileno(fin), &st) == -1 || st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "Binary decision object truncated\n");
+		return (NULL);
+	}
+
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+	    fileno(fin), 0);
+	if (p == MAP_FAILED) {
+		warn("mmap");
+		return (NULL);
+	}
+	hdr = p;
+
+	if (hdr->version != CD_BIN_VERSION || hdr->byteorder != CD_BIN_ORDER) {
+		fprintf(stderr, "Binary decision object has version %d or "
+		    "different byte order\n", hdr->version);
+		goto error;
+	}
+	if (st.st_size != sizeof(*hdr) + hdr->npoints * sizeof(double) ||
+	    memchr(hdr->name, '\0', sizeof(hdr->name)) == NULL ||
+	    memchr(hdr->transform, '\0', sizeof(hdr->transform)) == NULL) {
+		fprintf(stderr, "Binary decision object malformed\n");
+		goto error;
+	}
+
+	cd_bindigest(hdr, (double *)(hdr + 1), digest);
+	if (memcmp(digest, hdr->digest, sizeof(digest))) {
+		fprintf(stderr, "Binary decision object %s: bad checksum\n",
+		    hdr->name);
+		goto error;
+	}
+
+	if ((cdd = calloc(1, sizeof(struct cd_decision))) == NULL)
+		goto error;
+
+	cdd->mapped = 1;
+	cdd->name = hdr->name;
+	cdd->transform_name = hdr->transform;
+	cdd->npoints = hdr->npoints;
+	cdd->b = (double *)(hdr + 1);
+	cdd->projpos = hdr->projpos;
+	cdd->projneg = hdr->projneg;
+	cdd->k = hdr->k;
+
+	if ((cdd->transform = transform_lookup(cdd->transform_name)) == NULL) {
+		fprintf(stderr, "Unknown transforms \"%s\" for \"%s\"\n",
+		    cdd->transform_name, cdd->name);
+		free(cdd);
+		goto error;
+	}
+
+	fprintf(stderr, "Read detection for %s\n", cdd->name);
+	return (cdd);
+
+ error:
+	munmap(p, st.st_size);
+	return (NULL);
+}
+
+/*
+ * Reads a decision object, either in the binary format or in the
+ * text format written by cd_dump().
+ */
+
 struct cd_decision *
 cd_read(FILE *fin)
 {
-	char line[1024], *p, *str;
+	char line[1024], magic[sizeof(CD_BIN_MAGIC) - 1];
 	struct cd_decision *cdd;
-	int n;
+	int c, n;
+
+	if (fread(magic, sizeof(magic), 1, fin) == 1 &&
+	    !memcmp(magic, CD_BIN_MAGIC, sizeof(magic)))
+		return (cd_read_binary(fin));
+	rewind(fin);
 
 	if ((cdd = calloc(1, sizeof(struct cd_decision))) == NULL)
 		return (NULL);
@@ -359,21 +1166,17 @@ cd_read(FILE *fin)
 		goto error;
 	}
 
-	/* Read projection */
-	if (fgetl(line, sizeof(line), fin) == NULL)
-		goto error;
-
-	p = line;
-	str = strsep(&p, " ");
-	if (str == NULL || p == NULL)
-		goto error;
-	cdd->npoints = atoi(str);
-	cdd->b = cd_collect_data(p, &n);
-	if (cdd->b == NULL || cdd->npoints != n) {
-		fprintf(stderr, "Format %s: projection data malformed\n",
-		    cdd->name);
+	/* Read projection, the line may be longer than our buffer */
+	if (fscanf(fin, "%d", &cdd->npoints) != 1 || cdd->npoints <= 0)
+		goto malformed;
+	if ((cdd->b = malloc(cdd->npoints * sizeof(double))) == NULL)
 		goto error;
-	}
+	for (n = 0; n < cdd->npoints; n++)
+		if (fscanf(fin, "%lf", &cdd->b[n]) != 1)
+			goto malformed;
+	while ((c = getc(fin)) != '\n' && c != EOF)
+		if (!isspace(c))
+			goto malformed;
 
 	/* Read projection */
 	if (fgetl(line, sizeof(line), fin) == NULL)
@@ -387,6 +1190,8 @@ cd_read(FILE *fin)
 
 	fprintf(stderr, "Read detection for %s\n", cdd->name);
 	return (cdd);
+ malformed:
+	fprintf(stderr, "Format %s: projection data malformed\n", cdd->name);
  error:
 	if (cdd->name)
 		free(cdd->name);
@@ -397,16 +1202,76 @@ cd_read(FILE *fin)
 	return (NULL);
 }
 
+/*
+ * Solves covar * b = diff for the projection vector, b contains diff
+ * on entry.  If the covariance matrix is singular, e.g. because some
+ * features are constant or linearly dependent, a growing ridge is
+ * added to its diagonal until it becomes positive definite.
+ */
+
+#define CD_RIDGE_MIN	1e-12
+#define CD_RIDGE_MAX	1e-2
+
+void
+cd_solve(double *covar, int npoints, double *b)
+{
+	double *a, *diff, ridge, trace = 0;
+	size_t size = (size_t)npoints * npoints * sizeof(double);
+	int i;
+
+	a = malloc(size);
+	diff = malloc(npoints * sizeof(double));
+	if (a == NULL || diff == NULL)
+		err(1, "malloc");
+
+	memcpy(a, covar, size);
+	memcpy(diff, b, npoints * sizeof(double));
+	if (matrix_cholesky_solve(a, npoints, b) == 0)
+		goto done;
+
+	for (i = 0; i < npoints; i++)
+		trace += covar[i * npoints + i];
+	if (trace <= 0)
+		trace = npoints;
+
+	for (ridge = CD_RIDGE_MIN; ridge <= CD_RIDGE_MAX; ridge *= 10) {
+		memcpy(a, covar, size);
+		memcpy(b, diff, npoints * sizeof(double));
+		for (i = 0; i < npoints; i++)
+			a[i * npoints + i] += ridge * trace / npoints;
+
+		if (matrix_cholesky_solve(a, npoints, b) == 0) {
+			fprintf(stderr,
+			    "Covariance matrix is singular, using ridge %g\n",
+			    ridge * trace / npoints);
+			goto done;
+		}
+	}
+
+	errx(1, "%s: covariance matrix is not positive definite", __func__);
+
+ done:
+	free(diff);
+	free(a);
+}
+
 void
 cd_compute(struct cd_decision *cdd, char *name, int test)
 {
-	int i, j, npoints;
-	double *mestpos, *mestneg, **covarest;
+	int i, npoints;
+	double *mestpos, *mestneg, *covarest;
 	int nnegative, npositive;
 
-	if (cdd->nnegative < 2 || cdd->npositive < 2)
+	if (cdd->online) {
+		if (cdd->accpos.n + cdd->accpos.nblock < 2 ||
+		    cdd->accneg.n + cdd->accneg.nblock < 2)
+			errx(1, "Not enough data points for \"%s\"", name);
+	} else if (cdd->negative.n < 2 || cdd->positive.n < 2)
 		errx(1, "Not enough data points for \"%s\"", name);
 
+	if (cdd->mapped)
+		errx(1, "%s: cannot retrain a mapped decision", cdd->name);
+
 	/* Free memory if in use before */
 	if (cdd->name) {
 		free(cdd->name);
@@ -420,55 +1285,46 @@ cd_compute(struct cd_decision *cdd, char *name, int test)
 	npoints = cdd->npoints;
 	mestpos = malloc(npoints * sizeof(double));
 	mestneg = malloc(npoints * sizeof(double));
-	covarest = malloc(npoints * sizeof(double *));
+	covarest = malloc((size_t)npoints * npoints * sizeof(double));
 	if (mestpos == NULL || mestneg == NULL || covarest == NULL)
 		err(1, "malloc");
 
 	if ((cdd->name = strdup(name)) == NULL)
 		err(1, "strdup");
-	cdd->b = malloc(npoints * sizeof(double *));
+	cdd->b = malloc(npoints * sizeof(double));
 	if (cdd->b == NULL)
 		err(1, "malloc");
 
-	for (i = 0; i < npoints; i++) {
-		covarest[i] = malloc(npoints * sizeof(double));
-		if (covarest[i] == NULL)
-			err(1, "malloc");
-	}
-
 	/*
 	 * In the test case, we use 80% of the images to train our
 	 * system, and the remaining 20% to test is accuracy.
-	 * Otherwise, we want to use all images.
+	 * Otherwise, we want to use all images.  Online training
+	 * keeps no images to test with.
 	 */
-	if (test) {
-		npositive = cdd->npositive * CD_PERCENT;
-		nnegative = cdd->nnegative * CD_PERCENT;
-	} else {
-		npositive = cdd->npositive;
-		nnegative = cdd->nnegative;
-	}
-
-	cd_meanest(&cdd->positiveq, npositive, mestpos, npoints);
-	cd_meanest(&cdd->negativeq, nnegative, mestneg, npoints);
+	if (cdd->online)
+		cd_accum_estimate(cdd, mestpos, mestneg, covarest);
+	else {
+		if (test) {
+			npositive = cdd->positive.n * CD_PERCENT;
+			nnegative = cdd->negative.n * CD_PERCENT;
+		} else {
+			npositive = cdd->positive.n;
+			nnegative = cdd->negative.n;
+		}
 
-	cd_covarest(cdd, npositive, nnegative, mestpos, mestneg, covarest);
+		cd_meanest(&cdd->positive, npositive, mestpos, npoints);
+		cd_meanest(&cdd->negative, nnegative, mestneg, npoints);
 
-	matrix_invert(covarest, npoints);
+		cd_covarest(cdd, npositive, nnegative, mestpos, mestneg,
+		    covarest);
+	}
 
-	for (i = 0; i < npoints; i++) {
-		double diff, sum = 0;
-		for (j = 0; j < npoints; j++) {
-			diff = mestpos[j] - mestneg[j];
-			sum += covarest[i][j] * diff;
-		}
+	for (i = 0; i < npoints; i++)
+		cdd->b[i] = mestpos[i] - mestneg[i];
 
-		cdd->b[i] = sum;
-	}
+	cd_solve(covarest, npoints, cdd->b);
 
 	/* Free up memory */
-	for (i = 0; i < npoints; i++)
-		free(covarest[i]);
 	free(covarest);
 
 	cdd->projpos = cd_project(mestpos, cdd->b, npoints);
@@ -508,70 +1364,367 @@ cd_classify(struct cd_decision *cdd, double *points)
 	}
 }
 
-void
-cd_test(struct cd_decision *cdd)
+/* Held-out sample projected onto the discriminant */
+struct cd_score {
+	double val;
+	int positive;
+};
+
+int
+cd_score_cmp(const void *a, const void *b)
 {
-	struct cd_entry *tmp;
-	int negcorrect, poscorrect;
-	int negfalse, posfalse;
-	int nnegative, npositive;
-	double where, fprate;
-	int saved = 0, count, allcount;
+	const struct cd_score *sa = a, *sb = b;
+
+	if (sa->val > sb->val)
+		return (-1);
+	if (sa->val < sb->val)
+		return (1);
+	return (0);
+}
+
+/*
+ * Position of a projected value relative to the projected class
+ * means, 0 for the negative and 1 for the positive mean.  This is
+ * the scale used by cd_setboundary() and comparable across models.
+ */
 
-	fprintf(stderr, "%6.4f %6.4f\n", 1.0, 1.0);
-	for (where = -1; where <= 2; where += 0.15) {
-		negcorrect = negfalse = 0;
-		poscorrect = posfalse = 0;
+double
+cd_relative(double val, double projpos, double projneg)
+{
+	if (projpos == projneg)
+		return (val - projneg);
+	return ((val - projneg) / (projpos - projneg));
+}
 
-		cd_setboundary(cdd, where);
+#define CD_FPRATE	0.01	/* false positive rate we aim for */
+#define CD_ROCLINES	20	/* points of the curve printed to stderr */
 
-		npositive = cdd->npositive * CD_PERCENT;
-		nnegative = cdd->nnegative * CD_PERCENT;
+/*
+ * Sorts the relative scores of held-out samples.  Moving the boundary
+ * down through the sorted values gives the exact ROC curve.  Returns
+ * the lowest boundary that keeps the false positive rate below
+ * CD_FPRATE.  The full curve is written as CSV to roc if it is not
+ * NULL.
+ */
 
-		allcount = 0;
-		count = 0;
-		TAILQ_FOREACH(tmp, &cdd->negativeq, next) {
-			count++;
-			if (count <= nnegative)
-				continue;
+double
+cd_roc(struct cd_score *scores, int nscores, FILE *roc)
+{
+	int i, j, tp, fp, line, npos, nneg;
+	double val, next, where, best, fprate, tprate, errrate;
+
+	for (i = npos = 0; i < nscores; i++)
+		npos += scores[i].positive;
+	nneg = nscores - npos;
 
-			if (!cd_classify(cdd, tmp->points))
-				negcorrect++;
+	qsort(scores, nscores, sizeof(struct cd_score), cd_score_cmp);
+
+	if (roc != NULL)
+		fprintf(roc, "boundary,fprate,tprate,error\n");
+	fprintf(stderr, "%6.4f %6.4f\n", 0.0, 0.0);
+
+	best = scores[0].val + 1;
+	tp = fp = 0;
+	line = 0;
+	for (i = 0; i < nscores; i = j) {
+		/* Samples with the same value move together */
+		val = scores[i].val;
+		for (j = i; j < nscores && scores[j].val == val; j++) {
+			if (scores[j].positive)
+				tp++;
 			else
-				negfalse++;
-			allcount++;
+				fp++;
+		}
+		next = j < nscores ? scores[j].val : val - 1;
+		where = (val + next) / 2;
+
+		fprate = (double)fp / nneg;
+		tprate = (double)tp / npos;
+		errrate = (double)(fp + npos - tp) / nscores;
+
+		if (fprate <= CD_FPRATE)
+			best = where;
+
+		if (roc != NULL)
+			fprintf(roc, "%f,%f,%f,%f\n",
+			    where, fprate, tprate, errrate);
+		if (j == nscores || j * CD_ROCLINES / nscores > line) {
+			line = j * CD_ROCLINES / nscores;
+			fprintf(stderr, "%6.4f %6.4f - %6.5f\n",
+			    fprate, tprate, errrate);
 		}
+	}
 
-		count = 0;
-		TAILQ_FOREACH(tmp, &cdd->positiveq, next) {
-			count++;
-			if (count <= npositive)
+	fprintf(stderr, "Boundary %f for false positive rate %.4f\n",
+	    best, CD_FPRATE);
+
+	return (best);
+}
+
+/*
+ * Tests the decision computed from the first CD_PERCENT of each class
+ * on the remaining samples.
+ */
+
+void
+cd_test(struct cd_decision *cdd, FILE *roc)
+{
+	struct cd_score *scores;
+	struct cd_set *set[2];
+	double val;
+	int i, c, nscores, ntrain[2];
+
+	set[0] = &cdd->positive;
+	set[1] = &cdd->negative;
+	nscores = 0;
+	for (c = 0; c < 2; c++) {
+		ntrain[c] = set[c]->n * CD_PERCENT;
+		if (ntrain[c] == set[c]->n) {
+			fprintf(stderr, "Not enough data points to test "
+			    "\"%s\"\n", cdd->name);
+			cdd->where = 0.5;
+			return;
+		}
+		nscores += set[c]->n - ntrain[c];
+	}
+
+	if ((scores = malloc(nscores * sizeof(struct cd_score))) == NULL)
+		err(1, "malloc");
+
+	nscores = 0;
+	for (c = 0; c < 2; c++) {
+		for (i = ntrain[c]; i < set[c]->n; i++, nscores++) {
+			val = cd_project(set[c]->points +
+			    (size_t)i * cdd->npoints, cdd->b, cdd->npoints);
+			scores[nscores].val = cd_relative(val,
+			    cdd->projpos, cdd->projneg);
+			scores[nscores].positive = c == 0;
+		}
+	}
+
+	cdd->where = cd_roc(scores, nscores, roc);
+
+	free(scores);
+}
+
+/*
+ * k-fold cross-validation.  The rows of each class are shuffled in
+ * place and cut into k contiguous chunks.  The statistics of all
+ * chunks are computed in parallel; the training statistics of a fold
+ * are obtained by merging all chunks but the held-out one, so the
+ * feature vectors are only read once for training.  The folds are
+ * then solved and scored in parallel.  As scores are relative to the
+ * class means of their fold, the held-out scores of all folds form
+ * one ROC curve.
+ */
+
+#define CD_MAXFOLDS	32
+
+struct cd_chunkjob {
+	pthread_t tid;
+	struct cd_accum *acc;
+	double *points;
+	int nrows, npoints;
+};
+
+struct cd_foldjob {
+	pthread_t tid;
+	int fold, nfolds, npoints;
+	struct cd_set *set[2];
+	struct cd_accum *chunks[2];	/* nfolds per class */
+	struct cd_score *scores;
+	int nscores;
+	int errors;		/* misclassified with the boundary at 0.5 */
+};
+
+void
+cd_shuffle(struct cd_set *set, int npoints, unsigned short *state)
+{
+	double *tmp, *a, *b;
+	char *name;
+	int i, j;
+
+	if ((tmp = malloc(npoints * sizeof(double))) == NULL)
+		err(1, "malloc");
+
+	for (i = set->n - 1; i > 0; i--) {
+		j = erand48(state) * (i + 1);
+		if (j > i)
+			j = i;
+
+		a = set->points + (size_t)i * npoints;
+		b = set->points + (size_t)j * npoints;
+		memcpy(tmp, a, npoints * sizeof(double));
+		memcpy(a, b, npoints * sizeof(double));
+		memcpy(b, tmp, npoints * sizeof(double));
+
+		name = set->filenames[i];
+		set->filenames[i] = set->filenames[j];
+		set->filenames[j] = name;
+	}
+
+	free(tmp);
+}
+
+#define CD_CHUNK(n, f, k)	((long)(n) * (f) / (k))
+
+void *
+cd_chunkthread(void *arg)
+{
+	struct cd_chunkjob *job = arg;
+
+	cd_accum_rows(job->acc, job->points, job->nrows, job->npoints);
+
+	return (NULL);
+}
+
+void *
+cd_foldthread(void *arg)
+{
+	struct cd_foldjob *job = arg;
+	struct cd_accum train[2], *acc;
+	double *covar, *b, *row, projpos, projneg, rel;
+	int c, f, i, start, end, npoints = job->npoints;
+
+	covar = malloc((size_t)npoints * npoints * sizeof(double));
+	b = malloc(npoints * sizeof(double));
+	if (covar == NULL || b == NULL)
+		err(1, "malloc");
+
+	for (c = 0; c < 2; c++) {
+		memset(&train[c], 0, sizeof(train[c]));
+		cd_accum_init(&train[c], npoints);
+		for (f = 0; f < job->nfolds; f++) {
+			if (f == job->fold)
 				continue;
+			acc = &job->chunks[c][f];
+			cd_accum_merge(&train[c], acc->n, acc->mean,
+			    acc->comoment, npoints);
+		}
+	}
 
-			if (cd_classify(cdd, tmp->points))
-				poscorrect++;
-			else
-				posfalse++;
-			allcount++;
+	cd_accum_covar(&train[0], &train[1], npoints, covar);
+	for (i = 0; i < npoints; i++)
+		b[i] = train[0].mean[i] - train[1].mean[i];
+	cd_solve(covar, npoints, b);
+
+	projpos = cd_project(train[0].mean, b, npoints);
+	projneg = cd_project(train[1].mean, b, npoints);
+
+	job->nscores = job->errors = 0;
+	for (c = 0; c < 2; c++) {
+		start = CD_CHUNK(job->set[c]->n, job->fold, job->nfolds);
+		end = CD_CHUNK(job->set[c]->n, job->fold + 1, job->nfolds);
+		for (i = start; i < end; i++) {
+			row = job->set[c]->points + (size_t)i * npoints;
+			rel = cd_relative(cd_project(row, b, npoints),
+			    projpos, projneg);
+			job->scores[job->nscores].val = rel;
+			job->scores[job->nscores].positive = c == 0;
+			job->nscores++;
+
+			if ((rel > 0.5) != (c == 0))
+				job->errors++;
 		}
+		cd_accum_free(&train[c]);
+	}
 
-		fprate = (float)negfalse/(negfalse + negcorrect)*1.0;
-		fprintf(stderr, "%6.4f %6.4f - %6.5f\n", fprate,
-		    (float)poscorrect/(posfalse + poscorrect)*1.0,
-		    (float)(posfalse + negfalse)/allcount);
+	free(b);
+	free(covar);
+
+	return (NULL);
+}
+
+void
+cd_crossvalidate(struct cd_decision *cdd, int nfolds, FILE *roc)
+{
+	struct cd_chunkjob cjobs[2 * CD_MAXFOLDS];
+	struct cd_foldjob fjobs[CD_MAXFOLDS];
+	struct cd_accum *chunks[2];
+	struct cd_set *set[2];
+	struct cd_score *scores;
+	unsigned short state[3] = { 0x5354, 0x4547, 0x4344 };
+	double errrate, mean = 0, var = 0;
+	int c, f, t, nscores, npoints = cdd->npoints;
+
+	if (cdd->online || cdd->mapped)
+		errx(1, "Cross-validation needs the training data");
+	if (nfolds < 2 || nfolds > CD_MAXFOLDS)
+		errx(1, "Number of folds must be between 2 and %d",
+		    CD_MAXFOLDS);
+
+	set[0] = &cdd->positive;
+	set[1] = &cdd->negative;
+	for (c = 0; c < 2; c++) {
+		/* Every training set needs two samples of each class */
+		if (set[c]->n < 2 * nfolds)
+			errx(1, "Not enough data points for %d folds",
+			    nfolds);
+		cd_shuffle(set[c], npoints, state);
+
+		chunks[c] = calloc(nfolds, sizeof(struct cd_accum));
+		if (chunks[c] == NULL)
+			err(1, "calloc");
+	}
 
-		/* Find a false positive rate that is below 1% */
-		if (!saved && fprate < 1) {
-			saved = 1;
-			cdd->where = where;
+	for (t = 0, c = 0; c < 2; c++) {
+		for (f = 0; f < nfolds; f++, t++) {
+			cd_accum_init(&chunks[c][f], npoints);
+			cjobs[t].acc = &chunks[c][f];
+			cjobs[t].points = set[c]->points +
+			    CD_CHUNK(set[c]->n, f, nfolds) * npoints;
+			cjobs[t].nrows = CD_CHUNK(set[c]->n, f + 1, nfolds) -
+			    CD_CHUNK(set[c]->n, f, nfolds);
+			cjobs[t].npoints = npoints;
+			if (pthread_create(&cjobs[t].tid, NULL,
+				cd_chunkthread, &cjobs[t]) != 0)
+				err(1, "pthread_create");
 		}
 	}
+	for (t = 0; t < 2 * nfolds; t++)
+		pthread_join(cjobs[t].tid, NULL);
 
-	/* Did not find a good false positive rate, use the middle */
-	if (!saved)
-		cdd->where = 0.5;
+	nscores = set[0]->n + set[1]->n;
+	if ((scores = malloc(nscores * sizeof(struct cd_score))) == NULL)
+		err(1, "malloc");
 
-	fprintf(stderr, "%6.4f %6.4f\n", 0.0, 0.0);
+	for (f = 0; f < nfolds; f++) {
+		fjobs[f].fold = f;
+		fjobs[f].nfolds = nfolds;
+		fjobs[f].npoints = npoints;
+		for (c = 0; c < 2; c++) {
+			fjobs[f].set[c] = set[c];
+			fjobs[f].chunks[c] = chunks[c];
+		}
+		/* Held-out samples of earlier folds come first */
+		fjobs[f].scores = scores + CD_CHUNK(set[0]->n, f, nfolds) +
+		    CD_CHUNK(set[1]->n, f, nfolds);
+		if (pthread_create(&fjobs[f].tid, NULL,
+			cd_foldthread, &fjobs[f]) != 0)
+			err(1, "pthread_create");
+	}
+
+	for (f = 0; f < nfolds; f++) {
+		pthread_join(fjobs[f].tid, NULL);
+
+		errrate = (double)fjobs[f].errors / fjobs[f].nscores;
+		fprintf(stderr, "Fold %d: error %6.5f\n", f + 1, errrate);
+		mean += errrate;
+		var += errrate * errrate;
+	}
+	mean /= nfolds;
+	var = var / nfolds - mean * mean;
+	fprintf(stderr, "Error over %d folds: %6.5f +- %6.5f\n",
+	    nfolds, mean, var > 0 ? sqrt(var) : 0);
+
+	cdd->where = cd_roc(scores, nscores, roc);
+
+	for (c = 0; c < 2; c++) {
+		for (f = 0; f < nfolds; f++)
+			cd_accum_free(&chunks[c][f]);
+		free(chunks[c]);
+	}
+	free(scores);
 }
 
 char *
@@ -585,3 +1738,143 @@ cd_transform(struct cd_decision *cdd)
 {
 	return (cdd->transform);
 }
+
+void
+cd_group_free(struct cd_group *grp)
+{
+	free(grp->models);
+	free(grp->weights);
+	free(grp->scale);
+	free(grp->scores);
+	free(grp);
+}
+
+/* Builds the scoring groups from all decisions that have been inserted */
+
+void
+cd_compile(void)
+{
+	struct cd_group *grp;
+	struct cd_decision *cdd;
+	double d;
+	int m;
+
+	while ((grp = TAILQ_FIRST(&cdgroups)) != NULL) {
+		TAILQ_REMOVE(&cdgroups, grp, next);
+		cd_group_free(grp);
+	}
+
+	TAILQ_FOREACH(cdd, &cdq, next) {
+		TAILQ_FOREACH(grp, &cdgroups, next)
+			if (grp->transform == cdd->transform &&
+			    grp->npoints == cdd->npoints)
+				break;
+		if (grp == NULL) {
+			if ((grp = calloc(1, sizeof(struct cd_group))) == NULL)
+				err(1, "calloc");
+			grp->transform = cdd->transform;
+			grp->npoints = cdd->npoints;
+			TAILQ_INSERT_TAIL(&cdgroups, grp, next);
+		}
+		grp->nmodels++;
+	}
+
+	TAILQ_FOREACH(grp, &cdgroups, next) {
+		grp->models = calloc(grp->nmodels, sizeof(struct cd_decision *));
+		grp->weights = calloc((size_t)grp->nmodels * grp->npoints,
+		    sizeof(double));
+		grp->scale = calloc(grp->nmodels, sizeof(double));
+		grp->scores = calloc(grp->nmodels, sizeof(double));
+		if (grp->models == NULL || grp->weights == NULL ||
+		    grp->scale == NULL || grp->scores == NULL)
+			err(1, "calloc");
+		grp->nmodels = 0;
+	}
+
+	TAILQ_FOREACH(cdd, &cdq, next) {
+		TAILQ_FOREACH(grp, &cdgroups, next)
+			if (grp->transform == cdd->transform &&
+			    grp->npoints == cdd->npoints)
+				break;
+
+		m = grp->nmodels++;
+		grp->models[m] = cdd;
+		memcpy(grp->weights + (size_t)m * grp->npoints, cdd->b,
+		    grp->npoints * sizeof(double));
+
+		/* Same direction as the comparison in cd_classify() */
+		d = cdd->projpos - cdd->projneg;
+		grp->scale[m] = d != 0 ? 1 / d : -1;
+	}
+}
+
+struct cd_group *
+cd_group_iterate(struct cd_group *grp)
+{
+	if (grp == NULL)
+		return (TAILQ_FIRST(&cdgroups));
+	return (TAILQ_NEXT(grp, next));
+}
+
+transform_t
+cd_group_transform(struct cd_group *grp)
+{
+	return (grp->transform);
+}
+
+/*
+ * Scores a feature vector with all models of the group.  The score is
+ * the distance to the decision boundary in units of the distance
+ * between the projected class means; it is positive if the image
+ * is classified as positive, and can be compared across models.  Four
+ * rows of the weight matrix are multiplied at a time, each one summed
+ * in the same order as cd_project().  The scores are retrieved with
+ * cd_score().
+ */
+
+void
+cd_group_score(struct cd_group *grp, double *points, int npoints)
+{
+	double *w0, *w1, *w2, *w3, s0, s1, s2, s3, x;
+	int i, m, n = grp->nmodels;
+	struct cd_decision *cdd;
+
+	if (npoints != grp->npoints)
+		errx(1, "Transform returned %d data points, expected %d",
+		    npoints, grp->npoints);
+
+	for (m = 0; m + 4 <= n; m += 4) {
+		w0 = grp->weights + (size_t)m * npoints;
+		w1 = w0 + npoints;
+		w2 = w1 + npoints;
+		w3 = w2 + npoints;
+		s0 = s1 = s2 = s3 = 0;
+		for (i = 0; i < npoints; i++) {
+			x = points[i];
+			s0 += x * w0[i];
+			s1 += x * w1[i];
+			s2 += x * w2[i];
+			s3 += x * w3[i];
+		}
+		grp->scores[m] = s0;
+		grp->scores[m + 1] = s1;
+		grp->scores[m + 2] = s2;
+		grp->scores[m + 3] = s3;
+	}
+	for (; m < n; m++)
+		grp->scores[m] = cd_project(points,
+		    grp->weights + (size_t)m * npoints, npoints);
+
+	/* The boundary may have been moved after compiling */
+	for (m = 0; m < n; m++) {
+		cdd = grp->models[m];
+		grp->scores[m] = (grp->scores[m] - cdd->k) * grp->scale[m];
+		cdd->score = grp->scores[m];
+	}
+}
+
+double
+cd_score(struct cd_decision *cdd)
+{
+	return (cdd->score);
+}
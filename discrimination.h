@@ -39,18 +39,35 @@ struct cd_decision *cd_iterate(struct cd_decision *);
 
 struct cd_decision *cd_new(void);
 int cd_process_file(struct cd_decision *, char *);
+void cd_online(struct cd_decision *);
+void cd_dump_state(FILE *, struct cd_decision *);
+
+struct cd_features;
+struct cd_features *cd_features_open(char *, char *);
+void cd_features_add(struct cd_features *, char *, int, double *, int);
+void cd_features_close(struct cd_features *);
+
 void cd_compute(struct cd_decision *, char *name, int);
-void cd_test(struct cd_decision *);
+void cd_test(struct cd_decision *, FILE *);
+void cd_crossvalidate(struct cd_decision *, int, FILE *);
 int cd_classify(struct cd_decision *, double *);
 void cd_setboundary(struct cd_decision *, double);
 
 char *cd_name(struct cd_decision *);
 
+struct cd_group;
+void cd_compile(void);
+struct cd_group *cd_group_iterate(struct cd_group *);
+transform_t cd_group_transform(struct cd_group *);
+void cd_group_score(struct cd_group *, double *, int);
+double cd_score(struct cd_decision *);
+
 void cd_dump(FILE *, struct cd_decision *);
+void cd_dump_binary(FILE *, struct cd_decision *);
 struct cd_decision *cd_read(FILE *);
 
 transform_t cd_transform(struct cd_decision *);
 
-void matrix_invert(double **, int);
+int matrix_cholesky_solve(double *, int, double *);
 
 #endif /* _DISCRIMINATION_ */
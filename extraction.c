@@ -47,12 +47,18 @@
 struct transform {
 	char *name;
 	double *(*transform)(short *, int, int *);
+
+	/* Output for the current image, see transform_compute() */
+	double *points;
+	int npoints;
+	int valid;
 };
 
 double *spline_transform(short *, int, int *);
 double *gradient_transform(short *, int, int *);
 double *roughness_transform(short *, int, int *);
 double *diffsquare_transform(short *, int, int *);
+void block_compute(short *, int);
 
 struct transform cd_transforms[] = {
 	{ "spline", spline_transform },
@@ -75,6 +81,79 @@ transform_lookup(char *name)
 	return (NULL);
 }
 
+/*
+ * Forgets the transform outputs of the previous image.
+ */
+
+void
+transform_flush(void)
+{
+	struct transform *tmp;
+
+	for (tmp = &cd_transforms[0]; tmp->name != NULL; tmp++)
+		tmp->valid = 0;
+}
+
+/*
+ * Applies a transform to the current image.  Each transform is
+ * computed only once per image, its output is kept until the next
+ * call to transform_flush().  The transforms themselves return
+ * static buffers that other transforms may overwrite.
+ */
+
+void
+transform_store(transform_t transform, double *points, int npoints)
+{
+	struct transform *tmp;
+
+	for (tmp = &cd_transforms[0]; tmp->name != NULL; tmp++) {
+		if (tmp->transform == transform)
+			break;
+	}
+	if (tmp->name == NULL)
+		return;
+
+	if (npoints > tmp->npoints || tmp->points == NULL) {
+		free(tmp->points);
+		tmp->points = malloc(npoints * sizeof(double));
+		if (tmp->points == NULL)
+			err(1, "malloc");
+	}
+	memcpy(tmp->points, points, npoints * sizeof(double));
+	tmp->npoints = npoints;
+	tmp->valid = 1;
+}
+
+double *
+transform_compute(transform_t transform, short *dcts, int bits,
+    int *pnpoints)
+{
+	struct transform *tmp;
+	double *points;
+	int npoints;
+
+	for (tmp = &cd_transforms[0]; tmp->name != NULL; tmp++) {
+		if (tmp->transform == transform)
+			break;
+	}
+	if (tmp->name == NULL)
+		return (transform(dcts, bits, pnpoints));
+
+	if (!tmp->valid) {
+		/* Roughness and diffsquare come out of the same pass */
+		if (transform == roughness_transform ||
+		    transform == diffsquare_transform)
+			block_compute(dcts, bits);
+		else {
+			points = transform(dcts, bits, &npoints);
+			transform_store(transform, points, npoints);
+		}
+	}
+
+	*pnpoints = tmp->npoints;
+	return (tmp->points);
+}
+
 int
 compute_stats(double *hist, int size,
     double *pmean, double *pstd, double *pskew, double *pkurt)
@@ -121,6 +200,164 @@ compute_stats(double *hist, int size,
 	return (0);
 }
 
+/*
+ * Like compute_stats() but for a histogram: value i occurs count[i]
+ * times.  Returns the number of samples.
+ */
+
+double
+compute_wstats(u_int32_t *count, int size,
+    double *pmean, double *pstd, double *pskew, double *pkurt)
+{
+	double mean, std, skew, kurt;
+	double n, tmp, tmp2;
+	int i;
+
+	n = mean = 0;
+	for (i = 0; i < size; i++) {
+		n += count[i];
+		mean += (double)count[i] * i;
+	}
+
+	if (n < 2) {
+		*pstd = 0;
+		*pmean = 0;
+		*pskew = 0;
+		*pkurt = 0;
+		return (n);
+	}
+	mean /= n;
+
+	std = skew = kurt = 0;
+	for (i = 0; i < size; i++) {
+		if (count[i] == 0)
+			continue;
+		tmp = i - mean;
+		tmp2 = tmp*tmp;
+		std += count[i] * tmp2;
+		skew += count[i] * tmp2 * tmp;
+		kurt += count[i] * tmp2 * tmp2;
+	}
+	std = sqrt(std / (n - 1));
+
+	if (std != 0) {
+		skew = skew / (n - 1) / (std * std * std);
+		kurt = kurt / (n - 1) / (std * std * std * std) - 3;
+	} else {
+		skew = 0;
+		kurt = 0;
+	}
+
+	*pskew = skew;
+	*pstd = std;
+	*pmean = mean;
+	*pkurt = kurt;
+
+	return (n);
+}
+
+/*
+ * Central moments that can be accumulated in chunks, so that the
+ * statistics of a large number of samples can be computed without
+ * storing them.
+ */
+
+struct moments {
+	double n;
+	double mean;
+	double m2, m3, m4;	/* sums of powers of deviations */
+};
+
+/* Combines two sets of moments into the first one */
+
+void
+moments_merge(struct moments *a, struct moments *b)
+{
+	double n, delta, d2, na2, nb2;
+
+	if (b->n == 0)
+		return;
+	if (a->n == 0) {
+		*a = *b;
+		return;
+	}
+
+	n = a->n + b->n;
+	delta = b->mean - a->mean;
+	d2 = delta * delta;
+	na2 = a->n * a->n;
+	nb2 = b->n * b->n;
+
+	a->m4 += b->m4 +
+	    d2 * d2 * a->n * b->n * (na2 - a->n * b->n + nb2) / (n * n * n) +
+	    6 * d2 * (na2 * b->m2 + nb2 * a->m2) / (n * n) +
+	    4 * delta * (a->n * b->m3 - b->n * a->m3) / n;
+	a->m3 += b->m3 +
+	    d2 * delta * a->n * b->n * (a->n - b->n) / (n * n) +
+	    3 * delta * (a->n * b->m2 - b->n * a->m2) / n;
+	a->m2 += b->m2 + d2 * a->n * b->n / n;
+	a->mean += delta * b->n / n;
+	a->n = n;
+}
+
+/* Adds a chunk of samples to the moments */
+
+void
+moments_add(struct moments *m, double *data, int size)
+{
+	struct moments chunk;
+	double tmp, tmp2;
+	int i;
+
+	if (size == 0)
+		return;
+
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.n = size;
+	for (i = 0; i < size; i++)
+		chunk.mean += data[i];
+	chunk.mean /= size;
+
+	for (i = 0; i < size; i++) {
+		tmp = data[i] - chunk.mean;
+		tmp2 = tmp*tmp;
+		chunk.m2 += tmp2;
+		chunk.m3 += tmp2 * tmp;
+		chunk.m4 += tmp2 * tmp2;
+	}
+
+	moments_merge(m, &chunk);
+}
+
+/* Same results as compute_stats() */
+
+int
+moments_stats(struct moments *m, double *p)
+{
+	double std, skew, kurt;
+
+	if (m->n < 2) {
+		memset(p, 0, 4 * sizeof(double));
+		return (-1);
+	}
+
+	std = sqrt(m->m2 / (m->n - 1));
+	if (std != 0) {
+		skew = m->m3 / (m->n - 1) / (std * std * std);
+		kurt = m->m4 / (m->n - 1) / (std * std * std * std) - 3;
+	} else {
+		skew = 0;
+		kurt = 0;
+	}
+
+	*p++ = m->mean;
+	*p++ = std;
+	*p++ = skew;
+	*p++ = kurt;
+
+	return (0);
+}
+
 void
 spline_setup(double *x, double *y, int n, double *y2, double *u)
 {
@@ -159,43 +396,80 @@ spline_inter(double *x, double *y, double *y2, int n, int lo, int hi)
 }
 
 #define SPLINEN	10
+#define SPLINEH	(SPLINEN/2)
+#define SPLINEW	(SPLINEN + 1)
+
+/*
+ * The knots around an estimated bin are its neighbouring bins, so
+ * the value interpolated by spline_setup() and spline_inter() is a
+ * fixed linear combination of them.  The weights only depend on how
+ * many knots lie left and right of the bin; they are given as exact
+ * integers over a common denominator.  Tap k belongs to bin
+ * ind - SPLINEH + k.  Histogram counts are integers, so the
+ * estimate is computed without rounding errors.
+ */
+struct stencil {
+	double den;
+	double w[SPLINEW];
+};
+
+static const struct stencil spline_stencil[SPLINEH - 1][SPLINEH - 1] = {
+	{
+		{ 10, { 0, 0, 0, -3, 8, 0, 8, -3, 0, 0, 0 } },
+		{ 512, { 0, 0, 0, -156, 415, 0, 379, -168, 42, 0, 0 } },
+		{ 318, { 0, 0, 0, -97, 258, 0, 234, -98, 28, -7, 0 } },
+		{ 7120,
+		  { 0, 0, 0, -2172, 5777, 0, 5237, -2184, 588, -168, 42 } }
+	}, {
+		{ 512, { 0, 0, 42, -168, 379, 0, 415, -156, 0, 0, 0 } },
+		{ 12, { 0, 0, 1, -4, 9, 0, 9, -4, 1, 0, 0 } },
+		{ 6976,
+		  { 0, 0, 582, -2328, 5237, 0, 5201, -2184, 624, -156, 0 } },
+		{ 6508,
+		  { 0, 0, 543, -2172, 4886, 0, 4850, -2028, 546, -156, 39 } }
+	}, {
+		{ 318, { 0, -7, 28, -98, 234, 0, 258, -97, 0, 0, 0 } },
+		{ 6976,
+		  { 0, -156, 624, -2184, 5201, 0, 5237, -2328, 582, 0, 0 } },
+		{ 134, { 0, -3, 12, -42, 100, 0, 100, -42, 12, -3, 0 } },
+		{ 32336,
+		  { 0, -724, 2896, -10136, 24133, 0, 24121, -10088, 2716,
+		    -776, 194 } }
+	}, {
+		{ 7120,
+		  { 42, -168, 588, -2184, 5237, 0, 5777, -2172, 0, 0, 0 } },
+		{ 6508,
+		  { 39, -156, 546, -2028, 4850, 0, 4886, -2172, 543, 0, 0 } },
+		{ 32336,
+		  { 194, -776, 2716, -10088, 24121, 0, 24133, -10136, 2896,
+		    -724, 0 } },
+		{ 500, { 3, -12, 42, -156, 373, 0, 373, -156, 42, -12, 3 } }
+	}
+};
+
+/* Bins with all knots present */
+#define SPLINE_INTERIOR	(&spline_stencil[SPLINEH - 2][SPLINEH - 2])
 
 double
 esterror2(double *h, int ind, int max)
 {
-	int i, s, e, n, lo = 0, hi = 0;
+	const struct stencil *st;
+	int k, left, right;
 	double error;
-	double x[SPLINEN], y[SPLINEN];
-	double y2[SPLINEN], u[SPLINEN];
 
-	s = ind - SPLINEN/2;
-	if (s < 0)
-		s = 0;
-	e = ind + SPLINEN/2;
-	if (e > max)
-		e = max;
+	left = ind < SPLINEH ? ind : SPLINEH;
+	right = max - ind < SPLINEH ? max - ind : SPLINEH;
+	if (left < 2 || right < 2)
+		errx(1, "%s: not enough knots around %d", __func__, ind);
 
-	n = 0;
-	for (i = s; i <= e && n < SPLINEN; i++) {
-		if (i == ind) {
-			lo = n - 1;
-			hi = n;
-			continue;
-		}
-		x[n] = i;
-		y[n] = h[i];
-		n++;
-	}
+	st = &spline_stencil[left - 2][right - 2];
 
-	if (hi >= n)
-		err(1, "FUCK: %d,%d: %d >= %d", s, e, hi, n);
+	error = -st->den * h[ind];
+	for (k = SPLINEH - left; k <= SPLINEH + right; k++)
+		error += st->w[k] * h[ind - SPLINEH + k];
 
-	spline_setup(x, y, n, y2, u);
-
-	error = spline_inter(x, y, y2, n, lo, hi);
-	error -= h[ind];
-
-	return (abs(error));
+	/* The trained models expect the error truncated to an integer */
+	return (abs((int)(error / st->den)));
 }
 
 double
@@ -212,22 +486,16 @@ esterror(double *h, int ind)
 	return (sqrt(error1*error1 + error2*error2));
 }
 
-void
-histogram(short *data, int datsiz, double **psimple, int *pnsimple)
+/*
+ * Returns the number of histogram bins for values between min and
+ * max.  The histogram is centered on zero and its size is rounded up
+ * to a multiple of 512.
+ */
+
+int
+histogram_bins(short min, short max)
 {
-	int i, n, off;
-	short min, max;
-	double *hist;
-
-	min = 32767;
-	max = -32767;
-
-	for (i = 0; i < datsiz; i++) {
-		if (data[i] > max)
-			max = data[i];
-		if (data[i] < min)
-			min = data[i];
-	}
+	int n;
 
 	/* Round up to a multple of 512 and make sure that both min
 	 * and max fit.
@@ -238,62 +506,49 @@ histogram(short *data, int datsiz, double **psimple, int *pnsimple)
 		n = ((n + 511) / 512) * 512;
 	} while (n/2 < -min || n/2 <= max);
 
-	min = -n/2;
-		   
-	if ((hist = calloc(n, sizeof(double))) == NULL)
-		err(1, "calloc");
-
-	for (i = 0; i < datsiz; i++) {
-		off = data[i] - min;
-		if (off < 0 || off >= n)
-			errx(1, "Bad offset: %d\n", off);
-		hist[off]++;
-	}
-
-/*	for (i = 0; i < n; i++)
-		fprintf(stderr, "%d %d\n", i, (int)hist[i]);
-*/
-	*pnsimple = n;
-	*psimple = hist;
+	return (n);
 }
 
+/*
+ * Computes the error distribution of the spline estimate for a
+ * histogram.  herror needs to hold nsimple values.
+ */
+
 double
-distribution(int slot, short *data, int bits, double *p)
+distribution(double *simple, int nsimple, double *herror, double *p)
 {
 	double mean, std, skew, kurt;
-	int i, j, n, nsimple;
-	double *simple;
-	double *herror;
-	short *ndata;
-
-	n = bits / DCTSIZE2;
-
-	if ((ndata = malloc(n * sizeof(short))) == NULL)
-		err(1, "malloc");
+	const struct stencil *st;
+	int i, k;
 
-	for (j = 0; j < n; j++)
-		ndata[j] = data[j*DCTSIZE2 + slot];
+	herror[0] = herror[1] = 0;
+	herror[nsimple - 2] = herror[nsimple - 1] = 0;
 
-	histogram(ndata, n, &simple, &nsimple);
-
-	free(ndata);
+	/*
+	 * Away from the edges every bin uses the same stencil, so the
+	 * estimation error is a plain convolution over the histogram.
+	 */
+	st = SPLINE_INTERIOR;
+	for (i = SPLINEH; i < nsimple - SPLINEH; i++) {
+		double error = -st->den * simple[i];
 
-	if ((herror = calloc(nsimple, sizeof(double))) == NULL)
-		err(1, "malloc");
+		for (k = 0; k < SPLINEW; k++)
+			error += st->w[k] * simple[i - SPLINEH + k];
+		herror[i] = error / st->den;
+	}
 
 	for (i = 2; i < nsimple - 2; i++) {
-		if (simple[i] != 0)
+		if (simple[i] == 0)
+			herror[i] = 0;
+		else if (i < SPLINEH || i >= nsimple - SPLINEH)
 			herror[i] = esterror2(simple, i, nsimple-1)/simple[i];
 		else
-			herror[i] = 0;
+			herror[i] = abs((int)herror[i])/simple[i];
 		/* fprintf(stderr, "%d %f\n", i, herror[i]); */
 	}
 
 	compute_stats(herror, nsimple, &mean, &std, &skew, &kurt);
 
-	free(simple);
-	free(herror);
-
 	*p++ = mean;
 	*p++ = std;
 	*p++ = skew;
@@ -335,66 +590,39 @@ dependency(int one, int two, short *data, int bits,
     double *hmean, double *hstd, double *hskew, double *hkurt)
 {
 	double mean, std, skew, kurt;
-	int i, j, n;
-	short dct, dctnext;
-	u_short model[256][256];
-	double *simple[256];
-	size_t nsimple[256];
+	int i, dct, dctnext;
+	u_int32_t (*model)[256];
 
 	memset(hmean, 0, 256*sizeof(double));
 	memset(hstd, 0, 256*sizeof(double));
 	memset(hskew, 0, 256*sizeof(double));
 	memset(hkurt, 0, 256*sizeof(double));
 
-	memset(model, 0, sizeof(model));
-	memset(simple, 0, sizeof(simple));
-	for (i = 0; i < bits; i+= DCTSIZE2) {
-		dct = data[i + one];
-		dctnext = data[i + two];
+	if ((model = calloc(256, sizeof(*model))) == NULL)
+		err(1, "calloc");
 
-		dct += 128;
-		dctnext += 128;
+	for (i = 0; i < bits; i+= DCTSIZE2) {
+		dct = data[i + one] + 128;
+		dctnext = data[i + two] + 128;
 
-		if (dct > 255 || dctnext > 255)
+		if (dct < 0 || dct > 255 || dctnext < 0 || dctnext > 255)
 			continue;
 
 		model[dct][dctnext]++;
 	}
 
 	for (i = 0; i < 256; i++) {
-		double *p;
-		n = 0;
-		for (j = 0; j < 256; j++) {
-			n += model[i][j];
-		}
-		nsimple[i] = n;
-		simple[i] = malloc(n * sizeof(double));
-		if (simple[i] == NULL)
-			err(1, "malloc");
-
-		p = simple[i];
-		for (j = 0; j < 256; j++) {
-			n = model[i][j];
-			while (n-- > 0)
-				*p++ = j;
-		}
-	}
+		if (compute_wstats(model[i], 256,
+			&mean, &std, &skew, &kurt) <= 4)
+			continue;
 
-	n = 0;
-	for (i = 0; i < 256; i++) {
-		if (nsimple[i] > 4) {
-			compute_stats(simple[i], nsimple[i],
-			    &mean, &std, &skew, &kurt);
-			hmean[i] = mean;
-			hstd[i] = std;
-			hskew[i] = skew;
-			hkurt[i] = kurt;
-			n++;
-		}
+		hmean[i] = mean;
+		hstd[i] = std;
+		hskew[i] = skew;
+		hkurt[i] = kurt;
 	}
 
-	for (i = 0; i < 256; i++)
-		free(simple[i]);
+	free(model);
 
 	return (0);
 }
@@ -410,15 +638,62 @@ double *
 spline_transform(short *dcts, int bits, int *pnpoints)
 {
 	static double output[HOWMANY*4];
-	double *p;
-	int i;
+	short min[HOWMANY], max[HOWMANY], *block;
+	double *hist[HOWMANY], *base[HOWMANY];
+	int nhist[HOWMANY];
+	double *buf, *herror, *p;
+	int i, j, n, total, maxbins;
+
+	n = bits / DCTSIZE2;
+
+	for (i = 0; i < HOWMANY; i++) {
+		min[i] = 32767;
+		max[i] = -32767;
+	}
+
+	/* The slots are at the start of each block, so read them together */
+	for (j = 0, block = dcts; j < n; j++, block += DCTSIZE2) {
+		for (i = 0; i < HOWMANY; i++) {
+			if (block[i] > max[i])
+				max[i] = block[i];
+			if (block[i] < min[i])
+				min[i] = block[i];
+		}
+	}
+
+	total = maxbins = 0;
+	for (i = 0; i < HOWMANY; i++) {
+		nhist[i] = histogram_bins(min[i], max[i]);
+		total += nhist[i];
+		if (nhist[i] > maxbins)
+			maxbins = nhist[i];
+	}
+
+	/* All histograms and the error scratch space share one buffer */
+	if ((buf = calloc(total + maxbins, sizeof(double))) == NULL)
+		err(1, "calloc");
+
+	p = buf;
+	for (i = 0; i < HOWMANY; i++) {
+		hist[i] = p;
+		base[i] = p + nhist[i]/2;
+		p += nhist[i];
+	}
+	herror = p;
+
+	for (j = 0, block = dcts; j < n; j++, block += DCTSIZE2) {
+		for (i = 0; i < HOWMANY; i++)
+			base[i][block[i]]++;
+	}
 
 	p = output;
 	for (i = 0; i < HOWMANY; i++) {
-		distribution(i, dcts, bits, p);
+		distribution(hist[i], nhist[i], herror, p);
 		p += 4;
 	}
 
+	free(buf);
+
 	*pnpoints = HOWMANY*4;
 
 	return (output);
@@ -440,50 +715,101 @@ gradient_transform(short *dcts, int bits, int *pnpoints)
 	return (output);
 }
 
-double *
-roughness_transform(short *dcts, int bits, int *pnpoints)
-{
-	double mean, std, skew, kurt;
-	static double output[8];
-	double *poutput, *points;
-	int i, j, n, off, npoints;
+/*
+ * Computes the frequency averaged roughness and the row and column
+ * differences of all blocks in a single pass.  Either output may be
+ * NULL.  The per block values are collected in small chunks and
+ * folded into running moments.
+ */
 
-	n = bits / DCTSIZE2;
+#define BLOCKCHUNK	128
+#define NDIFFSQUARE	(2 * DCTSIZE)
 
-	if ((points = malloc(n * sizeof(double))) == NULL)
-		err(1, "malloc");
+void
+block_transform(short *dcts, int bits, double *prough, double *pdiff)
+{
+	double rough[BLOCKCHUNK], diff[NDIFFSQUARE][BLOCKCHUNK];
+	struct moments mrough, mdiff[NDIFFSQUARE];
+	double sum, weight, val1, val2;
+	short *block;
+	int i, j, k, n, nchunk;
 
-	/* Computes frequency averaged roughness */
-	for (i = 0; i < n; i++) {
-		double sum = 0, weight = 0, val;
+	memset(&mrough, 0, sizeof(mrough));
+	memset(mdiff, 0, sizeof(mdiff));
 
-		off = i * DCTSIZE2;
-		for (j = 0; j < DCTSIZE2; j++) {
-			int u, v;
-			val = dcts[off + j];
+	n = bits / DCTSIZE2;
+	nchunk = 0;
+	for (i = 0, block = dcts; i < n; i++, block += DCTSIZE2) {
+		if (prough != NULL) {
+			sum = weight = 0;
+			for (j = 0; j < DCTSIZE2; j++) {
+				int u, v;
+				val1 = block[j];
+
+				u = j / 8;
+				v = j % 8;
+
+				sum += (u*u + v*v) * val1 * val1;
+				weight += (u*u + v*v);
+			}
+			rough[nchunk] = sqrt(sum/weight);
+		}
 
-			u = j / 8;
-			v = j % 8;
+		if (pdiff != NULL) {
+			/* Differences along rows */
+			for (k = 0; k < DCTSIZE; k++) {
+				sum = weight = 0;
+				for (j = 0; j < DCTSIZE - 1; j++) {
+					val1 = block[k * DCTSIZE + j];
+					val2 = block[k * DCTSIZE + j + 1];
+
+					sum += (val2 - val1) * (val2 - val1);
+					weight += fabs(val1);
+				}
+				diff[k][nchunk] = sqrt(sum)/(weight + 1);
+			}
 
-			sum += (u*u + v*v) * val * val;
-			weight += (u*u + v*v);
+			/* Differences along columns */
+			for (k = 0; k < DCTSIZE; k++) {
+				sum = weight = 0;
+				for (j = 0; j < DCTSIZE - 1; j++) {
+					val1 = block[k + DCTSIZE * j];
+					val2 = block[k + DCTSIZE * (j + 1)];
+
+					sum += (val2 - val1) * (val2 - val1);
+					weight += fabs(val1);
+				}
+				diff[DCTSIZE + k][nchunk] =
+				    sqrt(sum)/(weight + 1);
+			}
 		}
-		points[i] = sqrt(sum/weight);
+
+		if (++nchunk < BLOCKCHUNK && i < n - 1)
+			continue;
+
+		if (prough != NULL)
+			moments_add(&mrough, rough, nchunk);
+		if (pdiff != NULL)
+			for (k = 0; k < NDIFFSQUARE; k++)
+				moments_add(&mdiff[k], diff[k], nchunk);
+		nchunk = 0;
 	}
 
-	compute_stats(points, n, &mean, &std, &skew, &kurt);
+	if (prough != NULL)
+		moments_stats(&mrough, prough);
+	if (pdiff != NULL)
+		for (k = 0; k < NDIFFSQUARE; k++)
+			moments_stats(&mdiff[k], pdiff + 4 * k);
+}
 
-	npoints = 0;
-	poutput = output;
-	*poutput++ = mean;
-	*poutput++ = std;
-	*poutput++ = skew;
-	*poutput++ = kurt;
-	npoints += 4;
+double *
+roughness_transform(short *dcts, int bits, int *pnpoints)
+{
+	static double output[8];
 
-	*pnpoints = npoints;
+	block_transform(dcts, bits, output, NULL);
 
-	free(points);
+	*pnpoints = 4;
 
 	return (output);
 }
@@ -491,72 +817,27 @@ roughness_transform(short *dcts, int bits, int *pnpoints)
 double *
 diffsquare_transform(short *dcts, int bits, int *pnpoints)
 {
-	double mean, std, skew, kurt;
-	static double output[64];
-	double *poutput, *points;
-	int i, j, k, n, off, npoints;
-
-	n = bits / DCTSIZE2;
-
-	if ((points = malloc(n * sizeof(double))) == NULL)
-		err(1, "malloc");
-
-	npoints = 0;
-	poutput = output;
-
-	for (k = 0; k < DCTSIZE; k++) {
-		for (i = 0; i < n; i++) {
-			double sum = 0;
-			double val1, val2, weight = 0;
+	static double output[NDIFFSQUARE * 4];
 
-			off = i * DCTSIZE2;
-			for (j = 0; j < DCTSIZE - 1; j++) {
-				val1 = dcts[off + k * DCTSIZE + j];
-				val2 = dcts[off + k * DCTSIZE + j + 1];
+	block_transform(dcts, bits, NULL, output);
 
-				sum += (val2 - val1) * (val2 - val1);
-				weight += abs(val1);
-			}
-			points[i] = sqrt(sum)/(weight + 1);
-		}
-		
-		compute_stats(points, n, &mean, &std, &skew, &kurt);
-
-		*poutput++ = mean;
-		*poutput++ = std;
-		*poutput++ = skew;
-		*poutput++ = kurt;
-		npoints += 4;
-	}
-
-	for (k = 0; k < DCTSIZE; k++) {
-		for (i = 0; i < n; i++) {
-			double sum = 0;
-			double val1, val2, weight = 0;
+	*pnpoints = NDIFFSQUARE * 4;
 
-			off = i * DCTSIZE2;
-			for (j = 0; j < DCTSIZE - 1; j++) {
-				val1 = dcts[off + k + DCTSIZE * j];
-				val2 = dcts[off + k + DCTSIZE * (j + 1)];
+	return (output);
+}
 
-				sum += (val2 - val1) * (val2 - val1);
-				weight += abs(val1);
-			}
-			points[i] = sqrt(sum)/(weight + 1);
-		}
-		
-		compute_stats(points, n, &mean, &std, &skew, &kurt);
-
-		*poutput++ = mean;
-		*poutput++ = std;
-		*poutput++ = skew;
-		*poutput++ = kurt;
-		npoints += 4;
-	}
+/*
+ * Fills the transform cache with both roughness and diffsquare
+ * features from a single pass over the blocks.
+ */
 
-	*pnpoints = npoints;
+void
+block_compute(short *dcts, int bits)
+{
+	double rough[4], diff[NDIFFSQUARE * 4];
 
-	free(points);
+	block_transform(dcts, bits, rough, diff);
 
-	return (output);
+	transform_store(roughness_transform, rough, 4);
+	transform_store(diffsquare_transform, diff, NDIFFSQUARE * 4);
 }
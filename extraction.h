@@ -34,4 +34,7 @@
 typedef double *(*transform_t)(short *, int, int *);
 transform_t transform_lookup(char *);
 
+void transform_flush(void);
+double *transform_compute(transform_t, short *, int, int *);
+
 #endif /* _EXTRACTION_ */
@@ -37,6 +37,7 @@
 #include <err.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <ctype.h>
 
 #include <jpeglib.h>
@@ -44,103 +45,53 @@
 #include "config.h"
 #include "common.h"
 
-#define SWAP(a, b) do { \
-	double tmp; \
-	tmp = (a); (a) = (b); (b) = tmp; \
-} while (0)
+/*
+ * Solves a x = b for a symmetric positive definite matrix a, stored
+ * row-major.  a is overwritten by its Cholesky factor and b by the
+ * solution.  Returns -1 if the matrix is not positive definite.
+ */
 
-void
-matrix_invert(double **a, int n)
+int
+matrix_cholesky_solve(double *a, int n, double *b)
 {
-	double big, pivinv, tmp;
-	int i, icol, irow, j, k, l, ll;
-
-	int *indxc, *indxr, *ipiv;
-
-	indxc = calloc(n, sizeof(int));
-	indxr = calloc(n, sizeof(int));
-	ipiv = calloc(n, sizeof(int));
-
-	if (indxc == NULL || indxr == NULL || ipiv == NULL)
-		err(1, "%s: malloc", __func__);
-
-	for (i = 0; i < n; i++) {
-		big = 0.0;
-		for (j = 0; j < n; j++) {
-			if (ipiv[j] == 1)
-				continue;
-
-			for (k = 0; k < n; k++) {
-				if (ipiv[k] == 0) {
-					if (fabs(a[j][k]) >= big) {
-						big = fabs(a[j][k]);
-						irow = j;
-						icol = k;
-					}
-				} else if (ipiv[k] > 1)
-					err(1, "%s: singular matrix",
-					    __func__);
-			}
-		}
-		++ipiv[icol];
-		if (irow != icol) {
-			for (l = 0; l < n; l++)
-				SWAP(a[irow][l], a[icol][l]);
+	double sum, *ai, *aj;
+	int i, j, k;
+
+	/* Lower triangle becomes L with a = L L^T */
+	for (j = 0; j < n; j++) {
+		aj = a + (size_t)j * n;
+		sum = aj[j];
+		for (k = 0; k < j; k++)
+			sum -= aj[k] * aj[k];
+		if (sum <= n * DBL_EPSILON * fabs(aj[j]) || sum <= 0)
+			return (-1);
+		aj[j] = sqrt(sum);
+
+		for (i = j + 1; i < n; i++) {
+			ai = a + (size_t)i * n;
+			sum = ai[j];
+			for (k = 0; k < j; k++)
+				sum -= ai[k] * aj[k];
+			ai[j] = sum / aj[j];
 		}
-		indxr[i] = irow;
-		indxc[i] = icol;
-		if (a[icol][icol] == 0.0)
-			err(1, "%s: singular matrix", __func__);
-		pivinv = 1.0 / a[icol][icol];
-		a[icol][icol] = 1.0;
-		for (l = 0; l < n; l++)
-			a[icol][l] *= pivinv;
-		for (ll = 0; ll < n; ll++)
-			if (ll != icol) {
-				tmp = a[ll][icol];
-				a[ll][icol] = 0.0;
-				for (l = 0; l < n; l++)
-					a[ll][l] -= a[icol][l] * tmp;
-			}
 	}
-	for (l = n - 1; l >= 0; l--) {
-		if (indxr[l] != indxc[l])
-			for (k = 0; k < n; k++)
-				SWAP(a[k][indxr[l]], a[k][indxc[l]]);
-	}
-
-	free(ipiv);
-	free(indxr);
-	free(indxc);
-}
-#undef SWAP
-
-void
-print_matrix(char *str, double **A, int m, int n )
-{
-	int i, j;
 
-	printf("%s:  (%d x %d)\n", str, m, n);
-	for (i = 0; i < m; i++) {
-		printf(">");
-		for (j = 0; j < n; j++) {
-			printf(" %4.2f", A[ i ][ j ]);
-		}
-		printf("\n");
+	/* Forward substitution with L */
+	for (i = 0; i < n; i++) {
+		ai = a + (size_t)i * n;
+		sum = b[i];
+		for (k = 0; k < i; k++)
+			sum -= ai[k] * b[k];
+		b[i] = sum / ai[i];
 	}
-}
 
-void
-test_matrix(void)
-{
-	double *A[2], B[2] = {1, 1.5}, C[2] = {0, 2};
-
-	A[0] = B;
-	A[1] = C;
-
-	print_matrix("A", A, 2, 2);
-
-	matrix_invert(A, 2);
+	/* Backward substitution with L^T */
+	for (i = n - 1; i >= 0; i--) {
+		sum = b[i];
+		for (k = i + 1; k < n; k++)
+			sum -= a[(size_t)k * n + i] * b[k];
+		b[i] = sum / a[(size_t)i * n + i];
+	}
 
-	print_matrix("A", A, 2, 2);
+	return (0);
 }
@@ -68,30 +68,39 @@ char *conv_tolower, *conv_toupper;
 	if (!rules_debug) return (NULL); \
 }
 
-#define VALUE { \
-	if (!(value = RULE)) { \
+#define VALUE(value) { \
+	if (!((value) = RULE)) { \
 		rules_errno = RULES_ERROR_END; \
-		return (NULL); \
+		return (-1); \
 	} \
 }
 
-#define POSITION { \
-	if ((pos = rules_length[(ARCH_INDEX)RULE]) == INVALID_LENGTH) { \
+#define POSITION(pos) { \
+	if (((pos) = rules_length[(ARCH_INDEX)RULE]) == INVALID_LENGTH) { \
 		if (LAST) \
 			rules_errno = RULES_ERROR_POSITION; \
 		else \
 			rules_errno = RULES_ERROR_END; \
-		return (NULL); \
+		return (-1); \
+	} \
+}
+
+/*
+ * An unknown class is only reported when the rule is applied to a word,
+ * the same as before the rules were compiled.
+ */
+#define CLASS_CODE { \
+	VALUE(op->match) \
+	if (op->match == '?') { \
+		VALUE(value) \
+		op->class = rules_classes[(ARCH_INDEX)value]; \
 	} \
 }
 
 #define CLASS(start, true, false) { \
-	if ((value = RULE) == '?') { \
-		if (!(class = rules_classes[(ARCH_INDEX)RULE])) { \
-			if (LAST) \
-				rules_errno = RULES_ERROR_CLASS; \
-			else \
-				rules_errno = RULES_ERROR_END; \
+	if (op->match == '?') { \
+		if (!(class = op->class)) { \
+			rules_errno = RULES_ERROR_CLASS; \
 			return (NULL); \
 		} \
 		for (pos = (start); (ARCH_INDEX)in[pos]; pos++) \
@@ -101,12 +110,8 @@ char *conv_tolower, *conv_toupper;
 			false; \
 		} \
 	} else { \
-		if (!value) { \
-			rules_errno = RULES_ERROR_END; \
-			return (NULL); \
-		} \
 		for (pos = (start); (ARCH_INDEX)in[pos]; pos++) \
-		if (in[pos] == value) { \
+		if (in[pos] == op->match) { \
 			true; \
 		} else { \
 			false; \
@@ -114,11 +119,6 @@ char *conv_tolower, *conv_toupper;
 	} \
 }
 
-#define SKIP_CLASS { \
-	VALUE \
-	if (value == '?') VALUE \
-}
-
 #define CONV(conv) { \
 	for (pos = 0; (out[pos] = (conv)[(ARCH_INDEX)in[pos]]); pos++); \
 }
@@ -263,41 +263,161 @@ char *rules_reject(char *rule, void *db)
 	return (rule - 1);
 }
 
+/*
+ * Parses a rule once, so that applying it does not have to look at the
+ * rule text again.  Positions and character classes are resolved here.
+ */
+int
+rules_compile(struct rules_compiled *compiled, char *rule, int split)
+{
+	struct rule_op *op;
+	char value;
+	int noop = 0;
+
+	memset(compiled, 0, sizeof(*compiled));
+
+	/* A lone ':' accepts even an empty word */
+	if (NEXT == ':' && !*(rule + 1))
+		rule++;
+
+	while (RULE) {
+		op = &compiled->ops[compiled->nops];
+		op->cmd = LAST;
+
+		switch (LAST) {
+		case ':':
+		case ' ':
+		case '\t':
+			/* They only reject empty words, as every command does */
+			noop = 1;
+			continue;
+
+		case 'l': case 'u': case 'c': case 'r': case 'd': case 'f':
+		case 'p': case '[': case ']': case 'C': case 't': case '{':
+		case '}': case 'S': case 'V': case 'R': case 'L': case 'P':
+		case 'I': case 'M': case 'Q': case '+':
+			break;
+
+		case '<': case '>': case '\'': case 'T': case 'D':
+			POSITION(op->pos)
+			break;
+
+		case '$': case '^':
+			VALUE(op->value)
+			break;
+
+		case 'x':
+			POSITION(op->pos)
+			POSITION(op->pos2)
+			break;
+
+		case 'i': case 'o':
+			POSITION(op->pos)
+			VALUE(op->value)
+			break;
+
+		case 's':
+			CLASS_CODE
+			VALUE(op->value)
+			break;
+
+		case '@': case '!': case '/': case '(': case ')':
+			CLASS_CODE
+			break;
+
+		case '=': case '%':
+			POSITION(op->pos)
+			CLASS_CODE
+			break;
+
+		case '1': case '2':
+			if (split >= 0)
+				break;
+			/* FALLTHROUGH */
+		default:
+			rules_errno = RULES_ERROR_UNKNOWN;
+			return (-1);
+		}
+
+		compiled->nops++;
+	}
+
+	if (!compiled->nops && noop)
+		compiled->ops[compiled->nops++].cmd = ':';
+
+	/* Common rules that do not need the interpreter */
+	compiled->type = RULES_INTERPRET;
+	if (compiled->nops == 0)
+		compiled->type = RULES_COPY;
+	else if (compiled->nops == 1 && compiled->ops[0].cmd == 'c')
+		compiled->type = RULES_CAPITALIZE;
+	else if (compiled->nops == 1 && compiled->ops[0].cmd == '$')
+		compiled->type = RULES_APPEND;
+
+	return (0);
+}
+
 char *
-rules_apply(char *word, char *rule, int split)
+rules_exec(struct rules_compiled *compiled, char *word, int split)
 {
 	static char buffer[3][RULE_WORD_SIZE * 2];
+	struct rule_op *op, *end = compiled->ops + compiled->nops;
 	char *in = buffer[0], *out = buffer[1];
 	char memory[RULE_WORD_SIZE];
 	int memory_empty, which;
-	char value, *class;
+	char *class;
 	int pos, out_pos;
 	int count, required;
 
+	switch (compiled->type) {
+	case RULES_COPY:
+		for (pos = 0; pos < rules_max_length && word[pos]; pos++)
+			out[pos] = word[pos];
+		out[pos] = 0;
+		return (out);
+
+	case RULES_CAPITALIZE:
+		if (!word[0] && !rules_debug)
+			return (NULL);
+		out[0] = conv_toupper[(ARCH_INDEX)word[0]];
+		for (pos = 1; pos < RULE_WORD_SIZE - 1 && word[pos]; pos++)
+			out[pos] = conv_tolower[(ARCH_INDEX)word[pos]];
+		out[pos] = 0;
+		if (out[0] == 'M' && out[1] == 'c')
+			out[2] = conv_toupper[(ARCH_INDEX)out[2]];
+		out[rules_max_length] = 0;
+		return (out);
+
+	case RULES_APPEND:
+		if (!word[0] && !rules_debug)
+			return (NULL);
+		for (pos = 0; pos < RULE_WORD_SIZE - 1 && word[pos]; pos++)
+			out[pos] = word[pos];
+		out[pos] = compiled->ops[0].value;
+		out[pos + 1] = 0;
+		out[rules_max_length] = 0;
+		return (out);
+	}
+
 	strncpy(in, word, RULE_WORD_SIZE);
 	memory_empty = 1; which = 0;
 
-	if (NEXT != ':' || *(rule + 1))
-	while (RULE) {
+	for (op = compiled->ops; op < end; op++) {
 		if (!in[0]) REJECT
 		in[RULE_WORD_SIZE - 1] = 0;
 
-		switch (LAST) {
+		switch (op->cmd) {
 /* Crack v4.1 rules */
 		case ':':
-		case ' ':
-		case '\t':
 			out = in;
 			break;
 
 		case '<':
-			POSITION
-			if ((int)strlen(in) < pos) out = in; else REJECT
+			if ((int)strlen(in) < op->pos) out = in; else REJECT
 			break;
 
 		case '>':
-			POSITION
-			if ((int)strlen(in) > pos) out = in; else REJECT
+			if ((int)strlen(in) > op->pos) out = in; else REJECT
 			break;
 
 		case 'l':
@@ -355,55 +475,45 @@ rules_apply(char *word, char *rule, int split)
 			break;
 
 		case '$':
-			VALUE
 			out = in;
-			out[pos = strlen(out)] = value;
+			out[pos = strlen(out)] = op->value;
 			out[pos + 1] = 0;
 			break;
 
 		case '^':
-			VALUE
-			out[0] = value;
+			out[0] = op->value;
 			strcpy(&out[1], in);
 			break;
 
 		case 'x':
-			POSITION
-			if (pos < (int)strlen(in)) {
-				in += pos;
-				POSITION
-				strlcpy(out, in, pos + 1);
-			} else {
-				POSITION
+			if (op->pos < (int)strlen(in)) {
+				in += op->pos;
+				strlcpy(out, in, op->pos2 + 1);
+			} else
 				out[0] = 0;
-			}
 			break;
 
 		case 'i':
-			POSITION
-			VALUE
+			pos = op->pos;
 			if (pos < (out_pos = strlen(in))) {
 				memcpy(out, in, pos);
-				out[pos] = value;
+				out[pos] = op->value;
 				strcpy(&out[pos + 1], &in[pos]);
 			} else {
 				out = in;
-				out[out_pos] = value;
+				out[out_pos] = op->value;
 				out[out_pos + 1] = 0;
 			}
 			break;
 
 		case 'o':
-			POSITION
-			VALUE
 			out = in;
-			if (out[pos]) out[pos] = value;
+			if (out[op->pos]) out[op->pos] = op->value;
 			break;
 
 		case 's':
 			out = in;
-			CLASS(0, out[pos] = NEXT, {})
-			VALUE
+			CLASS(0, out[pos] = op->value, {})
 			break;
 
 		case '@':
@@ -424,12 +534,10 @@ rules_apply(char *word, char *rule, int split)
 			break;
 
 		case '=':
-			POSITION
-			if (pos >= (int)strlen(in)) {
-				SKIP_CLASS
+			if (op->pos >= (int)strlen(in))
 				REJECT
-			} else
-				CLASS(pos, break, REJECT)
+			else
+				CLASS(op->pos, break, REJECT)
 			out = in;
 			break;
 
@@ -463,22 +571,19 @@ rules_apply(char *word, char *rule, int split)
 			break;
 
 		case ')':
-			if (!in[0]) {
-				SKIP_CLASS
+			if (!in[0])
 				REJECT
-			} else
+			else
 				CLASS(strlen(in) - 1, break, REJECT)
 			out = in;
 			break;
 
 		case '\'':
-			POSITION
-			(out = in)[pos] = 0;
+			(out = in)[op->pos] = 0;
 			break;
 
 		case '%':
-			POSITION
-			count = 0; required = pos;
+			count = 0; required = op->pos;
 			CLASS(0, if (++count >= required) break, {})
 			if (count < required) REJECT
 			out = in;
@@ -486,19 +591,17 @@ rules_apply(char *word, char *rule, int split)
 
 /* Rules added in John */
 		case 'T':
-			POSITION
 			out = in;
-			out[pos] = conv_invert[(ARCH_INDEX)out[pos]];
+			out[op->pos] = conv_invert[(ARCH_INDEX)out[op->pos]];
 			break;
 
 		case 'D':
-			POSITION
+			pos = op->pos;
 			if (pos >= (int)strlen(in)) out = in; else {
 				memcpy(out, in, pos);
 				strcpy(&out[pos], &in[pos + 1]);
 			}
 			break;
-
 		case '{':
 			if (in[0]) {
 				strcpy(out, &in[1]);
@@ -583,10 +686,6 @@ rules_apply(char *word, char *rule, int split)
 
 /* Additional "single crack" mode rules */
 		case '1':
-			if (split < 0) {
-				rules_errno = RULES_ERROR_UNKNOWN;
-				return (NULL);
-			}
 			if (!split) REJECT
 			if (which) strcpy(buffer[2], in);
 			else strlcpy(buffer[2], &word[split], RULE_WORD_SIZE);
@@ -595,10 +694,6 @@ rules_apply(char *word, char *rule, int split)
 			break;
 
 		case '2':
-			if (split < 0) {
-				rules_errno = RULES_ERROR_UNKNOWN;
-				return (NULL);
-			}
 			if (!split) REJECT
 			if (which) strcpy(buffer[2], in);
 			else strlcpy(buffer[2], word, split + 1);
@@ -652,6 +747,17 @@ rules_apply(char *word, char *rule, int split)
 	return (in);
 }
 
+char *
+rules_apply(char *word, char *rule, int split)
+{
+	static struct rules_compiled compiled;
+
+	if (rules_compile(&compiled, rule, split) == -1)
+		return (NULL);
+
+	return (rules_exec(&compiled, word, split));
+}
+
 int rules_check(struct rpp_context *start, int split)
 {
 	struct rpp_context ctx;
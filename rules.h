@@ -24,6 +24,34 @@
 #define RULES_ERROR_CLASS		4
 #define RULES_ERROR_REJECT		5
 
+/*
+ * How a compiled rule is applied.
+ */
+#define RULES_INTERPRET			0
+#define RULES_COPY			1
+#define RULES_CAPITALIZE		2
+#define RULES_APPEND			3
+
+/*
+ * A command with its arguments already parsed.
+ */
+struct rule_op {
+	char cmd;
+	char value;	/* character to insert or substitute */
+	char match;	/* character to match, '?' for class */
+	char *class;
+	int pos, pos2;
+};
+
+/*
+ * A rule, compiled once and then applied to every word.
+ */
+struct rules_compiled {
+	int type;
+	int nops;
+	struct rule_op ops[RULE_BUFFER_SIZE];
+};
+
 /*
  * Error names.
  */
@@ -64,6 +92,19 @@ extern char *rules_reject(char *rule, void *db);
  */
 extern char *rules_apply(char *word, char *rule, int split);
 
+/*
+ * Compiles a rule that has passed rules_reject(). Returns 0, or -1 and
+ * sets rules_errno on error.
+ */
+extern int rules_compile(struct rules_compiled *compiled, char *rule,
+    int split);
+
+/*
+ * Applies a compiled rule to a word, the same as rules_apply().
+ */
+extern char *rules_exec(struct rules_compiled *compiled, char *word,
+    int split);
+
 /*
  * Checks if all the rules for context are valid. Returns the number of rules,
  * or returns zero and sets rules_errno on error.
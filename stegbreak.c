@@ -48,10 +48,12 @@
 #include "common.h"
 #include "cfg.h"
 #include "rules.h"
+#include "arc4.h"
 #include "break_jphide.h"
 #include "break_outguess.h"
 #include "break_jsteg.h"
 #include "db.h"
+#include "wordlist.h"
 
 #ifndef PATH_MAX
 #define PATH_MAX	1024
@@ -66,11 +68,15 @@ char *progname;
 char *wordlist = "/usr/share/dict/words";
 
 int convert = 0;
+int exhaustive = 0;
+u_int64_t digest_first, digest_last;
 int quiet = 0;
+int cachewords = 0;
 int alarmed = 0;
 int signaled = 0;
-FILE *word_file;
-int line_number, rule_number, rule_count;
+struct wordlist *words;
+u_int64_t block_number, start_block;
+int rule_number, rule_count, start_rule;
 
 u_int32_t count, total_count;
 int found = 0;
@@ -80,24 +86,14 @@ time_t starttime;
 void
 status_print(char *word)
 {
-	struct stat stat;
-	long where;
-	int part_file;
 	struct timeval tv, rtv;
 	float rate = 0;
 
-	if (!word_file || word_file == stdin) {
+	if (words == NULL) {
 		fprintf(stderr, "Status: %s\n", word);
 		return;
 	}
 
-	if (fstat(fileno(word_file), &stat))
-		err(1, "fstat");
-	if ((where = ftell(word_file)) == -1)
-		err(1, "ftell");
-
-	part_file = where * 100 / (stat.st_size + 1);
-
 	gettimeofday(&tv, NULL);
 	timersub(&tv, &last_tv, &rtv); 
 	if (rtv.tv_sec)
@@ -106,17 +102,26 @@ status_print(char *word)
 	total_count += count;
 	count = 0;
 
-	fprintf(stderr, "Status: % 7.3f%%, % 8.1f c/s: %s\n",
-		(float)(rule_number * 100 + part_file) / rule_count,
-		rate,
-		word);
+	/* The position can be passed to -b to resume the attack */
+	if (words->stream != NULL)
+		fprintf(stderr, "Status: % 8.1f c/s, block %llu:%d: %s\n",
+		    rate, (unsigned long long)block_number, rule_number,
+		    word);
+	else
+		fprintf(stderr,
+		    "Status: % 7.3f%%, % 8.1f c/s, block %llu:%d: %s\n",
+		    (float)(block_number * rule_count + rule_number) * 100 /
+		    (words->nblocks * rule_count),
+		    rate, (unsigned long long)block_number, rule_number,
+		    word);
 }
 
 void
 usage(void)
 {
 	fprintf(stderr,
-		"Usage: %s [-V] [-r <rules>] [-f <wordlist>] [-t <schemes>] file.jpg ...\n",
+		"Usage: %s [-CV] [-j <threads>] [-r <rules>] [-f <wordlist>] [-t <schemes>]\n"
+		"       [-b <block>[:<rule>]] [-x <first>-<last>] file.jpg ...\n",
 		progname);
 }
 
@@ -136,18 +141,15 @@ sig_handle_inter(int sig)
 char *
 do_wordlist_crack(char *name)
 {
-	char line[LINE_BUFFER_SIZE];
 	struct rpp_context ctx;
-	int length;
-	char *rule, *word = NULL;
+	struct rules_compiled *rules;
+	int i, n, length, nrules, rules_left = 1;
+	char *rule, *block, *line, *word = NULL;
 	char last[RULE_WORD_SIZE];
-	int rules = 1;
 
-	if (name) {
-		if (!(word_file = fopen(name, "r")))
-			err(1, "fopen: %s", name);
-	} else
-		word_file = stdin;
+	/* Files are read once, pipes a block at a time */
+	if (words == NULL)
+		words = wordlist_load(name, cachewords);
 
 	length = 16;
 
@@ -160,9 +162,15 @@ do_wordlist_crack(char *name)
 	rules_init(length);
 	rule_count = rules_count(&ctx, -1);
 
-	line_number = rule_number = 0;
-
-	rule = rpp_next(&ctx);
+	/* Every rule is applied to a block of words before the next one */
+	if ((rules = calloc(rule_count, sizeof(struct rules_compiled))) == NULL)
+		err(1, "calloc");
+	for (nrules = 0; nrules < rule_count &&
+		 (rule = rpp_next(&ctx)) != NULL; )
+		if ((rule = rules_reject(rule, NULL)) &&
+		    rules_compile(&rules[nrules], rule, -1) == 0)
+			nrules++;
+	rule_count = nrules;
 
 	memset(last, ' ', length + 1);
 	last[length + 2] = 0;
@@ -175,61 +183,89 @@ do_wordlist_crack(char *name)
 	count = 0;
 	gettimeofday(&last_tv, NULL);
 
-	if (rule)
-		do {
-			if ((rule = rules_reject(rule, NULL)))
-				while (fgetl(line, sizeof(line), word_file)) {
-					line_number++;
-
-					if (signaled) {
-						alarm(1);
-						signaled = 0;
-						status_print(last);
-					}
-					if (alarmed) {
-						signal(SIGALRM,
-						       sig_handle_timer);
-						signal(SIGINT,
-						       sig_handle_inter);
-						alarmed = 0;
-					}
-
-					if (line[0] == '#')
-						if (!strncmp(line, "#!comment", 9))
-							continue;
-
-					word = rules_apply(line, rule, -1);
-					if (word == NULL)
-						continue;
-
-					if (!strcmp(word, last))
-						continue;
-
-					strcpy(last, word);
-			
-					if (db_crack(word) == 1) {
-						rules = 0;
-						break;
-					}
+	for (block_number = start_block; rules_left &&
+		 (block = wordlist_block(words, block_number, &n)) != NULL;
+	     block_number++) {
+		rule_number = block_number == start_block ? start_rule : 0;
+		for (; rules_left && rule_number < nrules; rule_number++) {
+			for (i = 0, line = block; i < n;
+			     i++, line += strlen(line) + 1) {
+				if (signaled) {
+					alarm(1);
+					signaled = 0;
+					status_print(last);
+				}
+				if (alarmed) {
+					signal(SIGALRM, sig_handle_timer);
+					signal(SIGINT, sig_handle_inter);
+					alarmed = 0;
 				}
 
-			if (rules) {
-				if (!(rule = rpp_next(&ctx))) break;
-				rule_number++;
+				word = rules_exec(&rules[rule_number], line, -1);
+				if (word == NULL)
+					continue;
+
+				if (!strcmp(word, last))
+					continue;
+
+				strcpy(last, word);
 
-				line_number = 0;
-				if (fseek(word_file, 0, SEEK_SET))
-					err(1, "fseek");
+				if (db_crack(word) == 1) {
+					rules_left = 0;
+					break;
+				}
 			}
-		} while (rules);
+		}
+	}
 
-	if (ferror(word_file))
-		err(1, "fgets");
+	free(rules);
 
-	if (name) {
-		if (fclose(word_file))
-			err(1, "fclose");
-		word_file = NULL;
+	alarm(0);
+	signal(SIGALRM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	db_flush();
+
+	return (!rules_left ? word : NULL);
+}
+
+/*
+ * Tries every JSteg digest from first to last.  The digests are handed
+ * to the crack functions as hex words, so the threads share them like
+ * words and a range can be split across machines.
+ */
+
+void
+do_digest_crack(u_int64_t first, u_int64_t last)
+{
+	char word[ARC4_DIGESTLEN * 2 + 1];
+	u_int64_t digest;
+
+	alarmed = signaled = 0;
+	signal(SIGALRM, sig_handle_timer);
+	signal(SIGINT, sig_handle_inter);
+
+	total_count += count;
+	count = 0;
+	gettimeofday(&last_tv, NULL);
+
+	for (digest = first; ; digest++) {
+		snprintf(word, sizeof(word), "%010llx",
+		    (unsigned long long)digest);
+
+		if (signaled) {
+			alarm(1);
+			signaled = 0;
+			status_print(word);
+		}
+		if (alarmed) {
+			signal(SIGALRM, sig_handle_timer);
+			signal(SIGINT, sig_handle_inter);
+			alarmed = 0;
+		}
+
+		if (db_crack(word) == 1 || digest == last)
+			break;
 	}
 
 	alarm(0);
@@ -237,8 +273,15 @@ do_wordlist_crack(char *name)
 	signal(SIGINT, SIG_DFL);
 
 	db_flush();
+}
 
-	return (!rules ? word : NULL);
+void
+do_crack(void)
+{
+	if (exhaustive)
+		do_digest_crack(digest_first, digest_last);
+	else
+		do_wordlist_crack(wordlist);
 }
 
 /*
@@ -351,36 +394,48 @@ jsteg_read_jpg(char *filename)
 struct handler {
 	int type;
 	char *extension;
-	int (*obj_crack)(char *, char *, void *);
+	int (*obj_crack)(char *, char *, void *, void *);
+	u_int32_t (*obj_hash)(void *);
 	int (*obj_compare)(void *, void *);
 	void (*obj_destroy)(void *);
 	int (*obj_write)(char *, void *);
 	void *(*obj_read)(char *);
 	void *(*obj_read_jpg)(char *);
+	void *(*state_new)(void);
+	void (*state_free)(void *);
+	int (*obj_crack_lanes)(char *, char **, int, void *, void *);
+	void (*obj_report)(char *, char *, void *, void *);
 };
 
 struct handler handlers[] = {
 	{
 		FLAG_DOJPHIDE, ".jph",
 		crack_jphide,
-		break_jphide_compare, break_jphide_destroy,
+		break_jphide_hash, break_jphide_compare, break_jphide_destroy,
 		break_jphide_write, break_jphide_read,
-		jphide_read_jpg
+		jphide_read_jpg,
+		break_jphide_state_new, break_jphide_state_free,
+		crack_jphide_lanes, break_jphide_report
 	},
 	{
 		FLAG_DOOUTGUESS, ".og",
 		crack_outguess,
-		NULL, break_outguess_destroy,
+		NULL, NULL, break_outguess_destroy,
 		break_outguess_write, break_outguess_read,
-		outguess_read_jpg
+		outguess_read_jpg,
+		break_outguess_state_new, break_outguess_state_free,
+		crack_outguess_lanes, break_outguess_report
 	},
 	{
 		FLAG_DOJSTEG, ".jsg",
 		crack_jsteg,
-		NULL, break_jsteg_destroy,
+		NULL, break_jsteg_compare, break_jsteg_destroy,
 		break_jsteg_write, break_jsteg_read,
-		jsteg_read_jpg
+		jsteg_read_jpg,
+		break_jsteg_state_new, break_jsteg_state_free,
+		crack_jsteg_lanes, break_jsteg_report
 	},
+	{ 0 }
 };
 
 int
@@ -401,11 +456,15 @@ doinsert(char *filename, int scans)
 		if (handle->extension == NULL)
 			return (-1);
 
+		/* The digests only apply to JSteg */
+		if (exhaustive && handle->type != FLAG_DOJSTEG)
+			return (-1);
+
 		if ((obj = handle->obj_read(filename)) == NULL)
 			return (-1);
 
 		db_insert(filename, handle->type, obj,
-		    handle->obj_crack, handle->obj_compare,
+		    handle->obj_crack, handle->obj_hash, handle->obj_compare,
 		    handle->obj_destroy);
 	} else {
 		res = -1;
@@ -424,6 +483,7 @@ doinsert(char *filename, int scans)
 				else
 					db_insert(filename, handle->type, obj,
 					    handle->obj_crack,
+					    handle->obj_hash,
 					    handle->obj_compare,
 					    handle->obj_destroy);
 
@@ -450,10 +510,12 @@ process_loop(char *name, int scans, int *pi, int *pn)
 		n++;
 	}
 
-	if (!convert && i >= MAX_FILES) {
+	/* Words from a pipe can only be read once */
+	if (!convert && i >= MAX_FILES &&
+	    (exhaustive || strcmp(wordlist, "-"))) {
 		fprintf(stderr, "Loaded %i files...\n",
 		    i);
-		do_wordlist_crack(wordlist);
+		do_crack();
 		i = 0;
 	}
 
@@ -464,7 +526,7 @@ process_loop(char *name, int scans, int *pi, int *pn)
 int
 main(int argc, char *argv[])
 {
-	int i, n, scans;
+	int i, n, scans, nthreads = 1;
 	extern char *optarg;
 	extern int optind;
 	int ch;
@@ -475,8 +537,23 @@ main(int argc, char *argv[])
 	scans = FLAG_DOJPHIDE;
 
 	/* read command line arguments */
-	while ((ch = getopt(argc, argv, "cqs:f:r:Vd:t:")) != -1)
+	while ((ch = getopt(argc, argv, "b:Ccqs:f:j:r:Vd:t:x:")) != -1)
 		switch((char)ch) {
+		case 'b': {
+			unsigned long long block;
+
+			start_rule = 0;
+			if (sscanf(optarg, "%llu:%d", &block, &start_rule) < 1 ||
+			    start_rule < 0) {
+				usage();
+				exit(1);
+			}
+			start_block = block;
+			break;
+		}
+		case 'C':
+			cachewords = 1;
+			break;
 		case 'c':
 			convert = 1;
 			break;
@@ -489,6 +566,27 @@ main(int argc, char *argv[])
 		case 'f':
 			wordlist = optarg;
 			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'x': {
+			unsigned long long first, last;
+			extern int jsteg_exhaustive;
+
+			if (sscanf(optarg, "%llx-%llx", &first, &last) != 2 ||
+			    first > last || last >> (ARC4_DIGESTLEN * 8)) {
+				usage();
+				exit(1);
+			}
+			digest_first = first;
+			digest_last = last;
+			exhaustive = jsteg_exhaustive = 1;
+			break;
+		}
 		case 'V':
 			fprintf(stdout, "Stegbreak Version %s\n", VERSION);
 			exit(1);
@@ -518,6 +616,9 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (exhaustive)
+		scans = FLAG_DOJSTEG;
+
 	if (argc < 1) {
 		usage();
 		exit(1);
@@ -528,8 +629,16 @@ main(int argc, char *argv[])
 		errx(1, "file magic initializiation failed");
 
         if (!convert) {
-		cfg_init(rules_name);
+		struct handler *handle;
+
+		if (!exhaustive)
+			cfg_init(rules_name);
 		db_init();
+		for (handle = &handlers[0]; handle->extension; handle++)
+			db_register(handle->type,
+			    handle->state_new, handle->state_free,
+			    handle->obj_crack_lanes, handle->obj_report);
+		db_start(nthreads);
 	}
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
@@ -588,12 +697,13 @@ main(int argc, char *argv[])
 
 	if (!convert && i) {
 		fprintf(stderr, "Loaded %i files...\n", i);
-		do_wordlist_crack(wordlist);
+		do_crack();
 	}
 
 	if (!convert) {
 		time_t now = time(NULL) - starttime;
 
+		db_stop();
 		total_count += count;
 		fprintf(stderr, "Processed %d files, found %d embeddings.\n",
 			n, found);
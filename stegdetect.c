@@ -29,6 +29,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include "config.h"
 
@@ -37,6 +38,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
@@ -80,8 +82,10 @@ float scale = 1;		/* Sensitivity scaling */
 
 extern int debug;
 static int quiet = 0;
+static int rawscores = 0;	/* Print the score of each decision */
 static int ispositive = 0;	/* Current images contain stego */
 static char *transformname;	/* Current transform name */
+static struct cd_features *features;	/* Binary feature output */
 
 static short *olddata;
 static int oldx, oldy;
@@ -1059,35 +1063,239 @@ detect_print(void)
 	fprintf(stdout, "]> ");
 }
 
+void
+class_output(char *filename, int positive, double *points, int npoints)
+{
+	int i;
+
+	if (features != NULL) {
+		cd_features_add(features, filename, positive, points, npoints);
+		return;
+	}
+
+	fprintf(stdout, "%s:%d,%s: ", filename, positive, transformname);
+
+	for (i = 0; i < npoints; i++) {
+		fprintf(stdout, "%.8f ", points[i]);
+	}
+
+	fprintf(stdout, "\n");
+}
+
 void
 class_discrimination(char *filename, int positive)
 {
 	double *points;
 	short *dcts = NULL;
-	int bits, i, npoints;
+	int bits, npoints;
 
 	if (prepare_all(&dcts, &bits) == -1)
 		err(1, "prepare_all");
 
 	points = transform(dcts, bits, &npoints);
+	class_output(filename, positive, points, npoints);
 
-	fprintf(stdout, "%s:%d,%s: ", filename, positive, transformname);
+	free(dcts);
+}
 
-	for (i = 0; i < npoints; i++) {
-		fprintf(stdout, "%.8f ", points[i]);
+/*
+ * Extracting training data for a large corpus.  The decoder and the
+ * transforms keep their state in globals, so the work is spread over
+ * forked processes instead of threads.  Worker i handles every
+ * nworkers-th image and sends the feature vectors back over a pipe;
+ * reading the pipes in turn keeps the output in input order.
+ */
+
+struct class_job {
+	char *filename;
+	int positive;
+};
+
+static struct class_job *jobs;
+static int njobs, jobsize;
+static int nworkers = 1;
+
+void
+class_addjob(char *filename, int positive)
+{
+	if (njobs >= jobsize) {
+		jobsize = jobsize ? jobsize * 2 : 1024;
+		jobs = realloc(jobs, jobsize * sizeof(struct class_job));
+		if (jobs == NULL)
+			err(1, "realloc");
 	}
 
-	fprintf(stdout, "\n");
+	if ((jobs[njobs].filename = strdup(filename)) == NULL)
+		err(1, "strdup");
+	jobs[njobs].positive = positive;
+	njobs++;
+}
 
-	free(dcts);
+/* Each line of a manifest is "<label> <filename>" */
+
+void
+class_readmanifest(char *filename)
+{
+	FILE *fin;
+	char line[1024], *p;
+	int lineno = 0;
+
+	if ((fin = fopen(filename, "r")) == NULL)
+		err(1, "fopen: %s", filename);
+
+	while (fgetl(line, sizeof(line), fin) != NULL) {
+		lineno++;
+		p = line;
+		if (!isdigit(*p))
+			errx(1, "%s:%d: missing label", filename, lineno);
+		while (isdigit(*p))
+			p++;
+		if (!isspace(*p))
+			errx(1, "%s:%d: missing filename", filename, lineno);
+		while (isspace(*p))
+			p++;
+		if (*p == '\0')
+			errx(1, "%s:%d: missing filename", filename, lineno);
+
+		class_addjob(p, atoi(line));
+	}
+
+	fclose(fin);
+}
+
+int
+class_io(int fd, void *buf, size_t size, int dowrite)
+{
+	u_char *p = buf;
+	ssize_t res;
+
+	while (size > 0) {
+		res = dowrite ? write(fd, p, size) : read(fd, p, size);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return (-1);
+		p += res;
+		size -= res;
+	}
+
+	return (0);
+}
+
+void
+class_worker(int fd, int worker)
+{
+	double *points;
+	short *dcts;
+	int bits, i, npoints;
+
+	for (i = worker; i < njobs; i += nworkers) {
+		/* Images that can not be read are skipped */
+		npoints = -1;
+		points = NULL;
+		if (jpg_open(jobs[i].filename) != -1) {
+			dcts = NULL;
+			if (prepare_all(&dcts, &bits) == -1)
+				err(1, "prepare_all");
+			points = transform(dcts, bits, &npoints);
+			free(dcts);
+
+			jpg_finish();
+			jpg_destroy();
+		}
+
+		if (class_io(fd, &npoints, sizeof(npoints), 1) == -1 ||
+		    (npoints > 0 && class_io(fd, points,
+			npoints * sizeof(double), 1) == -1))
+			err(1, "write");
+	}
+}
+
+void
+class_parallel(void)
+{
+	pid_t *pids;
+	double *points = NULL;
+	int *fds, pfd[2];
+	int i, w, npoints, size = 0, status;
+
+	if ((pids = calloc(nworkers, sizeof(pid_t))) == NULL ||
+	    (fds = calloc(nworkers, sizeof(int))) == NULL)
+		err(1, "calloc");
+
+	/* Children must not flush our buffers a second time */
+	fflush(NULL);
+
+	for (w = 0; w < nworkers; w++) {
+		if (pipe(pfd) == -1)
+			err(1, "pipe");
+
+		if ((pids[w] = fork()) == -1)
+			err(1, "fork");
+		if (pids[w] == 0) {
+			for (i = 0; i < w; i++)
+				close(fds[i]);
+			close(pfd[0]);
+			class_worker(pfd[1], w);
+			_exit(0);
+		}
+
+		close(pfd[1]);
+		fds[w] = pfd[0];
+	}
+
+	for (i = 0; i < njobs; i++) {
+		w = i % nworkers;
+		if (class_io(fds[w], &npoints, sizeof(npoints), 0) == -1)
+			errx(1, "worker %d terminated early", w);
+		if (npoints < 0)
+			continue;
+
+		if (npoints > size) {
+			size = npoints;
+			points = realloc(points, size * sizeof(double));
+			if (points == NULL)
+				err(1, "realloc");
+		}
+		if (class_io(fds[w], points, npoints * sizeof(double), 0) == -1)
+			errx(1, "worker %d terminated early", w);
+
+		class_output(jobs[i].filename, jobs[i].positive,
+		    points, npoints);
+	}
+
+	for (w = 0; w < nworkers; w++) {
+		close(fds[w]);
+		if (waitpid(pids[w], &status, 0) == -1)
+			err(1, "waitpid");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errx(1, "worker %d failed", w);
+	}
+
+	free(points);
+	free(fds);
+	free(pids);
+}
+
+void
+write_binary(char *filename, struct cd_decision *cdd)
+{
+	FILE *fout;
+
+	if ((fout = fopen(filename, "w")) == NULL)
+		err(1, "fopen: %s", filename);
+	cd_dump_binary(fout, cdd);
+	if (fclose(fout) == EOF)
+		err(1, "fclose: %s", filename);
 }
 
 void
 usage(void)
 {
 	fprintf(stderr,
-	    "Usage: %s [-nqV] [-s <float>] [-d <num>] [-t <tests>] [-C <num>]\n"
-	    "\t [file.jpg ...]\n",
+	    "Usage: %s [-nqrV] [-s <float>] [-d <num>] [-t <tests>] [-C <num>]\n"
+	    "\t [-o] [-k <folds>] [-S <file>] [-B <file>] [-R <file>]\n"
+	    "\t [-M <manifest>] [-j <num>] [file.jpg ...]\n",
 		progname);
 }
 
@@ -1181,24 +1389,40 @@ detect(char *filename, int scans)
 
 	if (scans & FLAG_DOCLASSDIS) {
 		struct cd_decision *cdd;
+		struct cd_group *grp;
 		double *points;
 		int npoints;
 
 		if (prepare_all(&dcts, &bits) == -1)
 			err(1, "prepare_all");
 
+		/* Decisions that share a transform are scored together */
+		transform_flush();
+		for (grp = cd_group_iterate(NULL); grp;
+		    grp = cd_group_iterate(grp)) {
+			points = transform_compute(cd_group_transform(grp),
+			    dcts, bits, &npoints);
+			cd_group_score(grp, points, npoints);
+		}
+
 		for (cdd = cd_iterate(NULL); cdd; cdd = cd_iterate(cdd)) {
-			transform_t transform = cd_transform(cdd);
-			points = transform(dcts, bits, &npoints);
-			res = cd_classify(cdd, points);
+			res = cd_score(cdd) > 0;
 
-			if (!res)
+			if (!res && !rawscores)
 				continue;
 
 			flag = 1;
 			strlcat(outbuf, " ", sizeof(outbuf));
 			strlcat(outbuf, cd_name(cdd), sizeof(outbuf));
-			strlcat(outbuf, "(**)", sizeof(outbuf));
+			if (res)
+				strlcat(outbuf, "(**)", sizeof(outbuf));
+			if (rawscores) {
+				char score[32];
+
+				snprintf(score, sizeof(score), "[%.4f]",
+				    cd_score(cdd));
+				strlcat(outbuf, score, sizeof(outbuf));
+			}
 		}
 
 		free(dcts);
@@ -1400,31 +1624,63 @@ detect(char *filename, int scans)
 int
 main(int argc, char *argv[])
 {
-	int i, scans, checkhdr = 0, usecd = 0, histonly = 0;
+	int i, scans, checkhdr = 0, histonly = 0, online = 0, ncdfiles = 0;
+	int nfolds = 0;
 	struct cd_decision *cdd = NULL;
-	FILE *fin;
+	char *binfile = NULL, *rocfile = NULL, *manifest = NULL;
+	char *statefile = NULL, **cdfiles;
+	FILE *fin, *roc = NULL;
 	extern char *optarg;
 	extern int optind;
 	int ch;
 
 	progname = argv[0];
 
+	/* Training data is read once all options are known */
+	if ((cdfiles = calloc(argc, sizeof(char *))) == NULL)
+		err(1, "calloc");
+
 	scans = FLAG_DOOUTGUESS | FLAG_DOJPHIDE | FLAG_DOJSTEG | FLAG_DOINVIS |
 	    FLAG_DOF5 | FLAG_DOAPPEND;
 
 	cd_init();
 
 	/* read command line arguments */
-	while ((ch = getopt(argc, argv, "C:D:c:nhs:Vd:t:q")) != -1)
+	while ((ch = getopt(argc, argv, "B:C:D:M:R:S:c:j:k:nohrs:Vd:t:q")) != -1)
 		switch((char)ch) {
+		case 'B':
+			binfile = optarg;
+			break;
+		case 'R':
+			rocfile = optarg;
+			break;
+		case 'M':
+			manifest = optarg;
+			break;
+		case 'j':
+			if ((nworkers = atoi(optarg)) < 1) {
+				usage();
+				exit(1);
+			}
+			break;
 		case 'h':
 			histonly = 1;
 			break;
 		case 'c':
-			if (cdd == NULL)
-				cdd = cd_new();
-			cd_process_file(cdd, optarg);
-			usecd = 1;
+			cdfiles[ncdfiles++] = optarg;
+			break;
+		case 'o':
+			online = 1;
+			break;
+		case 'k':
+			if ((nfolds = atoi(optarg)) < 2) {
+				usage();
+				exit(1);
+			}
+			break;
+		case 'S':
+			statefile = optarg;
+			online = 1;
 			break;
 		case 'D':
 			if ((fin = fopen(optarg, "r")) == NULL)
@@ -1436,11 +1692,12 @@ main(int argc, char *argv[])
 			cd_insert(cdd);
 			break;
 		case 'C': {
-			char *strnum, *strtrans, *p;
+			char *strnum, *strtrans, *strfile, *p;
 			
 			p = optarg;
 			strnum = strsep(&p, ",");
 			strtrans = strsep(&p, ",");
+			strfile = strsep(&p, ",");
 
 			if (strnum == NULL || strtrans == NULL ||
 			    !isdigit(*optarg)) {
@@ -1460,6 +1717,9 @@ main(int argc, char *argv[])
 			ispositive = atoi(optarg);
 			if ((transformname = strdup(strtrans)) == NULL)
 				err(1, "strdup");
+			if (strfile != NULL && *strfile != '\0')
+				features = cd_features_open(strfile,
+				    transformname);
 			break;
 		}
 		case 'n':
@@ -1468,6 +1728,9 @@ main(int argc, char *argv[])
 		case 'q':
 			quiet = 1;
 			break;
+		case 'r':
+			rawscores = 1;
+			break;
 		case 's':
 			if ((scale = atof(optarg)) == 0) {
 				usage();
@@ -1525,19 +1788,62 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (usecd) {
+	if (ncdfiles) {
 		char *name;
 
+		cdd = cd_new();
+		if (online)
+			cd_online(cdd);
+		for (i = 0; i < ncdfiles; i++)
+			cd_process_file(cdd, cdfiles[i]);
+
+		if (statefile != NULL) {
+			FILE *fout;
+
+			if ((fout = fopen(statefile, "w")) == NULL)
+				err(1, "fopen: %s", statefile);
+			cd_dump_state(fout, cdd);
+			if (fclose(fout) == EOF)
+				err(1, "fclose: %s", statefile);
+			exit(0);
+		}
+
 		if (argc > 0)
 			name = argv[0];
 		else
 			name = "<unknown program>";
 
-		cd_compute(cdd, name, 1);
-		cd_test(cdd);
+		/* Online training keeps no images to test with */
+		if (!online) {
+			if (rocfile != NULL &&
+			    (roc = fopen(rocfile, "w")) == NULL)
+				err(1, "fopen: %s", rocfile);
+
+			if (nfolds)
+				cd_crossvalidate(cdd, nfolds, roc);
+			else {
+				cd_compute(cdd, name, 1);
+				cd_test(cdd, roc);
+			}
+
+			if (roc != NULL && fclose(roc) == EOF)
+				err(1, "fclose: %s", rocfile);
+		} else if (rocfile != NULL || nfolds)
+			errx(1, "-R and -k can not be used with online training");
 
 		cd_compute(cdd, name, 0);
 		cd_dump(stdout, cdd);
+		if (binfile != NULL)
+			write_binary(binfile, cdd);
+		exit(0);
+	}
+
+	/* Convert a decision object into the binary format */
+	if (binfile != NULL) {
+		cdd = cd_iterate(NULL);
+		if (cdd == NULL || cd_iterate(cdd) != NULL)
+			errx(1, "-B requires exactly one decision object");
+		write_binary(binfile, cdd);
 		exit(0);
 	}
 
@@ -1557,10 +1863,35 @@ main(int argc, char *argv[])
 
 		cd_setboundary(cdd, 1 - where);
 	}
+	cd_compile();
 
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
-	if (argc > 0) {
+	if (manifest != NULL && scans != FLAG_DOTRANSF)
+		errx(1, "-M requires -C");
+
+	if (scans == FLAG_DOTRANSF && (manifest != NULL || nworkers > 1)) {
+		char line[1024];
+
+		if (manifest != NULL)
+			class_readmanifest(manifest);
+		else if (argc > 0) {
+			for (i = 0; i < argc; i++)
+				class_addjob(argv[i], ispositive);
+		} else {
+			while (fgetl(line, sizeof(line), stdin) != NULL)
+				class_addjob(line, ispositive);
+		}
+
+		if (nworkers > 1)
+			class_parallel();
+		else {
+			for (i = 0; i < njobs; i++) {
+				ispositive = jobs[i].positive;
+				detect(jobs[i].filename, scans);
+			}
+		}
+	} else if (argc > 0) {
 		while (argc) {
 			if (histonly)
 				dohistogram(argv[0]);
@@ -1580,6 +1911,9 @@ main(int argc, char *argv[])
 				detect(line, scans);
 	}
 
+	if (features != NULL)
+		cd_features_close(features);
+
 	if (debug & FLAG_JPHIDESTAT) {
 		fprintf(stdout, "Positive rejected because of\n"
 		    "\tRunlength: %d\n"
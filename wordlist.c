@@ -0,0 +1,414 @@
+/*
+ * Copyright 2002 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Niels Provos.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#include "config.h"
+#include "cfg.h"
+#include "wordlist.h"
+
+#define WL_MAGIC	0x53425701
+
+/* Header of the compiled wordlist, followed by the arena and index */
+struct wlheader {
+	u_int32_t magic;
+	u_int32_t pad;
+	u_int64_t srcsize;
+	u_int64_t srcmtime;
+	u_int64_t size;
+	u_int64_t nwords;
+	u_int64_t nblocks;
+};
+
+#define WL_ALIGN(x)	(((x) + 7) & ~7)
+
+#ifndef MIN
+#define MIN(a,b)	((a) < (b) ? (a) : (b))
+#endif
+
+static struct wordlist *
+wordlist_new(void)
+{
+	struct wordlist *wl;
+
+	if ((wl = calloc(1, sizeof(struct wordlist))) == NULL)
+		err(1, "calloc");
+
+	return (wl);
+}
+
+/* Reads the whole file, leaves one spare byte at the end */
+
+static char *
+wordlist_read(int fd, char *name, size_t *plen)
+{
+	struct stat sb;
+	char *buf;
+	size_t len = 0, bufsize = 1024 * 1024;
+	ssize_t n;
+
+	if (fstat(fd, &sb) == -1)
+		err(1, "fstat: %s", name);
+	if (S_ISREG(sb.st_mode))
+		bufsize = sb.st_size + 1;
+
+	if ((buf = malloc(bufsize)) == NULL)
+		err(1, "malloc");
+
+	for (;;) {
+		if (len + 1 == bufsize) {
+			bufsize *= 2;
+			if ((buf = realloc(buf, bufsize)) == NULL)
+				err(1, "realloc");
+		}
+		n = read(fd, buf + len, bufsize - len - 1);
+		if (n == -1)
+			err(1, "read: %s", name);
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	*plen = len;
+	return (buf);
+}
+
+/*
+ * Splits the lines in place into NUL terminated words.  Lines are
+ * treated as fgetl() would: long lines are truncated, and a CR before
+ * the newline is removed.  Comments are dropped.
+ */
+
+static void
+wordlist_compile(struct wordlist *wl, char *buf, size_t len)
+{
+	char *p = buf, *end = buf + len, *eol, *nul, *q = buf;
+	size_t n, maxblocks = 0;
+
+	while (p < end) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+		n = eol - p;
+		if (n > LINE_BUFFER_SIZE - 1)
+			n = LINE_BUFFER_SIZE - 1;
+		else if (eol < end && n && p[n - 1] == '\r')
+			n--;
+		if ((nul = memchr(p, '\0', n)) != NULL)
+			n = nul - p;
+
+		if (n >= 9 && !strncmp(p, "#!comment", 9)) {
+			p = eol + 1;
+			continue;
+		}
+
+		if (wl->nwords % WL_BLOCK == 0) {
+			if (wl->nblocks == maxblocks) {
+				maxblocks = maxblocks ? maxblocks * 2 : 64;
+				wl->blocks = realloc(wl->blocks,
+				    maxblocks * sizeof(u_int64_t));
+				if (wl->blocks == NULL)
+					err(1, "realloc");
+			}
+			wl->blocks[wl->nblocks++] = q - buf;
+		}
+		wl->nwords++;
+
+		memmove(q, p, n);
+		q[n] = '\0';
+		q += n + 1;
+
+		p = eol + 1;
+	}
+
+	wl->size = q - buf;
+	if ((wl->arena = realloc(buf, wl->size + 1)) == NULL)
+		err(1, "realloc");
+}
+
+/*
+ * Checks that the index of a compiled wordlist agrees with its arena,
+ * so that a stale or corrupt cache can not point outside of it.
+ */
+
+static int
+wordlist_verify(struct wordlist *wl)
+{
+	char *p, *end = wl->arena + wl->size;
+	u_int64_t i;
+
+	if (wl->nblocks != (wl->nwords + WL_BLOCK - 1) / WL_BLOCK)
+		return (-1);
+	if (wl->size && end[-1] != '\0')
+		return (-1);
+
+	for (i = 0, p = wl->arena; i < wl->nwords; i++, p++) {
+		if (p >= end)
+			return (-1);
+		if (i % WL_BLOCK == 0 &&
+		    wl->blocks[i / WL_BLOCK] != p - wl->arena)
+			return (-1);
+		p = memchr(p, '\0', end - p);
+	}
+
+	return (p == end ? 0 : -1);
+}
+
+/* Maps a compiled wordlist if it is still current */
+
+static struct wordlist *
+wordlist_map(char *cache, struct stat *src)
+{
+	struct wordlist *wl;
+	struct wlheader *hdr;
+	struct stat sb;
+	void *p;
+	size_t off;
+	int fd;
+
+	if ((fd = open(cache, O_RDONLY)) == -1)
+		return (NULL);
+	if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(struct wlheader)) {
+		close(fd);
+		return (NULL);
+	}
+
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		warn("mmap: %s", cache);
+		return (NULL);
+	}
+
+	hdr = p;
+	if (hdr->size > sb.st_size - sizeof(struct wlheader) ||
+	    hdr->nblocks > sb.st_size / sizeof(u_int64_t)) {
+		munmap(p, sb.st_size);
+		return (NULL);
+	}
+	off = WL_ALIGN(sizeof(struct wlheader) + hdr->size);
+	if (hdr->magic != WL_MAGIC ||
+	    hdr->srcsize != src->st_size || hdr->srcmtime != src->st_mtime ||
+	    off + hdr->nblocks * sizeof(u_int64_t) != sb.st_size) {
+		munmap(p, sb.st_size);
+		return (NULL);
+	}
+
+	wl = wordlist_new();
+	wl->map = p;
+	wl->maplen = sb.st_size;
+	wl->arena = (char *)p + sizeof(struct wlheader);
+	wl->size = hdr->size;
+	wl->nwords = hdr->nwords;
+	wl->blocks = (u_int64_t *)((char *)p + off);
+	wl->nblocks = hdr->nblocks;
+
+	if (wordlist_verify(wl) == -1) {
+		wordlist_free(wl);
+		return (NULL);
+	}
+
+	return (wl);
+}
+
+static void
+wordlist_save(struct wordlist *wl, char *cache, struct stat *src)
+{
+	struct wlheader hdr;
+	char tmp[1024], pad[8];
+	size_t off;
+	FILE *fout;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache) >= sizeof(tmp)) {
+		warnx("%s: name too long", cache);
+		return;
+	}
+	if ((fd = mkstemp(tmp)) == -1) {
+		warn("mkstemp: %s", tmp);
+		return;
+	}
+	if ((fout = fdopen(fd, "w")) == NULL) {
+		warn("fdopen");
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = WL_MAGIC;
+	hdr.srcsize = src->st_size;
+	hdr.srcmtime = src->st_mtime;
+	hdr.size = wl->size;
+	hdr.nwords = wl->nwords;
+	hdr.nblocks = wl->nblocks;
+
+	off = WL_ALIGN(sizeof(hdr) + wl->size) - (sizeof(hdr) + wl->size);
+	memset(pad, 0, sizeof(pad));
+
+	fwrite(&hdr, sizeof(hdr), 1, fout);
+	fwrite(wl->arena, wl->size, 1, fout);
+	fwrite(pad, off, 1, fout);
+	fwrite(wl->blocks, sizeof(u_int64_t), wl->nblocks, fout);
+
+	if (ferror(fout)) {
+		warnx("%s: write failed", tmp);
+		fclose(fout);
+		unlink(tmp);
+		return;
+	}
+	if (fclose(fout) == EOF || rename(tmp, cache) == -1) {
+		warn("%s", cache);
+		unlink(tmp);
+	}
+}
+
+/* Reads the next block from the stream, each line as fgetl() returns it */
+
+static int
+wordlist_fill(struct wordlist *wl)
+{
+	char line[LINE_BUFFER_SIZE];
+	size_t len;
+
+	wl->size = wl->nwords = 0;
+	while (wl->nwords < WL_BLOCK &&
+	    fgetl(line, sizeof(line), wl->stream) != NULL) {
+		if (!strncmp(line, "#!comment", 9))
+			continue;
+
+		len = strlen(line) + 1;
+		while (wl->size + len > wl->arenasize) {
+			wl->arenasize = wl->arenasize ?
+			    wl->arenasize * 2 : 64 * 1024;
+			if ((wl->arena = realloc(wl->arena,
+				 wl->arenasize)) == NULL)
+				err(1, "realloc");
+		}
+		memcpy(wl->arena + wl->size, line, len);
+		wl->size += len;
+		wl->nwords++;
+	}
+	if (ferror(wl->stream))
+		err(1, "fgets");
+
+	wl->next++;
+	return (wl->nwords);
+}
+
+/*
+ * Returns the first word of a block and sets the number of words in
+ * it, or returns NULL after the last block.
+ */
+
+char *
+wordlist_block(struct wordlist *wl, u_int64_t block, int *pn)
+{
+	if (wl->stream == NULL) {
+		if (block >= wl->nblocks)
+			return (NULL);
+		*pn = MIN(WL_BLOCK, wl->nwords - block * WL_BLOCK);
+		return (wl->arena + wl->blocks[block]);
+	}
+
+	/* A stream can skip ahead, but not go back */
+	while (wl->next <= block)
+		if (wordlist_fill(wl) == 0)
+			return (NULL);
+	if (wl->next != block + 1)
+		return (NULL);
+
+	*pn = wl->nwords;
+	return (wl->arena);
+}
+
+/*
+ * Loads a wordlist, "-" reads it block by block from stdin.  With cache
+ * set, the compiled wordlist is kept next to the file and mapped next
+ * time.
+ */
+
+struct wordlist *
+wordlist_load(char *name, int cache)
+{
+	struct wordlist *wl;
+	struct stat sb;
+	char cachename[1024], *buf;
+	size_t len;
+	int fd;
+
+	if (!strcmp(name, "-")) {
+		wl = wordlist_new();
+		wl->stream = stdin;
+		return (wl);
+	}
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+		err(1, "open: %s", name);
+	if (fstat(fd, &sb) == -1)
+		err(1, "fstat: %s", name);
+
+	if (snprintf(cachename, sizeof(cachename), "%s%s", name,
+	    WL_CACHEEXT) >= sizeof(cachename))
+		cache = 0;
+	if (cache && (wl = wordlist_map(cachename, &sb)) != NULL) {
+		close(fd);
+		return (wl);
+	}
+
+	wl = wordlist_new();
+	buf = wordlist_read(fd, name, &len);
+	close(fd);
+	wordlist_compile(wl, buf, len);
+
+	if (cache)
+		wordlist_save(wl, cachename, &sb);
+
+	return (wl);
+}
+
+void
+wordlist_free(struct wordlist *wl)
+{
+	if (wl->map != NULL)
+		munmap(wl->map, wl->maplen);
+	else {
+		free(wl->arena);
+		free(wl->blocks);
+	}
+	free(wl);
+}
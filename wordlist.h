@@ -0,0 +1,66 @@
+/*
+ * Copyright 2002 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Niels Provos.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _WORDLIST_H_
+#define _WORDLIST_H_
+
+#define WL_BLOCK	1024		/* words per block */
+
+/*
+ * A wordlist that has been read into memory once.  The words are
+ * stored back to back as NUL terminated strings, with comments and
+ * line endings removed.  Every WL_BLOCK'th word is indexed, so that
+ * a pass can start at any block without scanning from the beginning.
+ *
+ * Words from a pipe are not kept.  They are read one block at a time
+ * into the arena, and the blocks can only be visited in order.
+ */
+struct wordlist {
+	char *arena;
+	u_int64_t size;
+	u_int64_t nwords;
+	u_int64_t *blocks;		/* arena offset of each block */
+	u_int64_t nblocks;
+
+	void *map;			/* of the cache file */
+	size_t maplen;
+
+	FILE *stream;
+	u_int64_t next;			/* next block in the stream */
+	size_t arenasize;
+};
+
+#define WL_CACHEEXT	".wl"
+
+struct wordlist *wordlist_load(char *, int);
+char *wordlist_block(struct wordlist *, u_int64_t, int *);
+void wordlist_free(struct wordlist *);
+
+#endif /* _WORDLIST_H_ */